@@ -0,0 +1,59 @@
+#include "arena.h"
+#include "memory.h"
+#include <string.h>
+
+// Keeps every allocation aligned for the widest type stored in a chunk.
+#define ARENA_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+void initArena(Arena *arena) {
+	arena->blocks = NULL;
+	arena->last = NULL;
+}
+
+void freeArena(Arena *arena) {
+	ArenaBlock *block = arena->blocks;
+	while (block != NULL) {
+		ArenaBlock *next = block->next;
+		reallocate(block, sizeof(ArenaBlock) + block->size, 0);
+		block = next;
+	}
+	initArena(arena);
+}
+
+static void *arenaAllocate(Arena *arena, size_t size) {
+	size = ARENA_ALIGN(size);
+	ArenaBlock *block = arena->blocks;
+	if (block == NULL || block->used + size > block->size) {
+		size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = (ArenaBlock *)reallocate(NULL, 0, sizeof(ArenaBlock) + blockSize);
+		block->size = blockSize;
+		block->used = 0;
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+	void *result = block->data + block->used;
+	block->used += size;
+	arena->last = result;
+	return result;
+}
+
+void *arenaReallocate(Arena *arena, void *pointer, size_t oldSize, size_t newSize) {
+	if (newSize <= oldSize)
+		return newSize == 0 ? NULL : pointer;
+
+	// The newest allocation just takes more of its block when there's room, which is the common
+	// case for a chunk's code while the compiler appends to it.
+	ArenaBlock *block = arena->blocks;
+	if (pointer != NULL && pointer == arena->last) {
+		size_t offset = (size_t)((uint8_t *)pointer - block->data);
+		if (offset + ARENA_ALIGN(newSize) <= block->size) {
+			block->used = offset + ARENA_ALIGN(newSize);
+			return pointer;
+		}
+	}
+
+	void *result = arenaAllocate(arena, newSize);
+	if (oldSize > 0)
+		memcpy(result, pointer, oldSize);
+	return result;
+}
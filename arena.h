@@ -0,0 +1,31 @@
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common.h"
+
+// Size of a regular arena block. Requests bigger than this get a block of their own.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+	struct ArenaBlock *next;
+	size_t size;
+	size_t used;
+	// Allocations are carved out of the bytes that follow the header.
+	uint8_t data[];
+} ArenaBlock;
+
+// Bump allocator for data that all dies at the same moment, i.e. the buffers of the chunks being
+// built during one compile() call. Nothing is freed individually, freeArena() releases it all.
+typedef struct {
+	ArenaBlock *blocks;
+	// Most recent allocation, the only one that can still grow in place.
+	void *last;
+} Arena;
+
+void initArena(Arena *arena);
+void freeArena(Arena *arena);
+// Same contract as reallocate() in memory.h, but the memory comes from the arena. Shrinking and
+// freeing are no-ops.
+void *arenaReallocate(Arena *arena, void *pointer, size_t oldSize, size_t newSize);
+
+#endif
@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+"""Runs the Lox programs in this directory and reports how the interpreter did on each.
+
+Every program runs --runs times. The report holds the median wall time, the peak resident memory
+and, when `perf` can count them, the CPU instructions retired. It is written as JSON so a later
+run can be compared against it:
+
+    run.py --interpreter build/mainbench --output baseline.json
+    run.py --interpreter build/mainbench --compare baseline.json
+
+With --compare, any benchmark whose median time or peak memory grew by more than --threshold, or
+whose output changed, is flagged and the exit status is 1.
+"""
+
+import argparse
+import ctypes
+import hashlib
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+from signal import SIGTRAP
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+libc = ctypes.CDLL(None, use_errno=True)
+PTRACE_TRACEME = 0
+PTRACE_CONT = 7
+PTRACE_SETOPTIONS = 0x4200
+PTRACE_O_TRACEEXIT = 0x40
+PTRACE_O_EXITKILL = 0x100000
+PTRACE_EVENT_EXIT = 6
+
+
+def trace_me():
+    libc.ptrace(PTRACE_TRACEME, 0, None, None)
+
+
+def peak_rss_kb(pid):
+    with open(f"/proc/{pid}/status") as status:
+        for line in status:
+            if line.startswith("VmHWM:"):
+                return int(line.split()[1])
+    return None
+
+
+def run_once(command):
+    """Runs command, returns (seconds, peak RSS in KB, stdout).
+
+    Linux folds the parent's peak RSS into a child's ru_maxrss when the child execs, so wait4()
+    would report at least Python's own footprint. Instead the child runs under ptrace and its
+    VmHWM is read while it is stopped on its way out, with its memory still mapped.
+    """
+    with tempfile.TemporaryFile() as out:
+        start = time.perf_counter()
+        process = subprocess.Popen(
+            command, stdout=out, stderr=subprocess.DEVNULL, preexec_fn=trace_me
+        )
+        pid = process.pid
+        peak = None
+        while True:
+            _, status, usage = os.wait4(pid, 0)
+            if not os.WIFSTOPPED(status):
+                break
+            signal = os.WSTOPSIG(status)
+            if signal == SIGTRAP and status >> 16 == PTRACE_EVENT_EXIT:
+                peak = peak_rss_kb(pid)
+                signal = 0
+            elif signal == SIGTRAP and peak is None:
+                # The stop right after exec, ask to be stopped again on exit.
+                libc.ptrace(PTRACE_SETOPTIONS, pid, None, PTRACE_O_TRACEEXIT | PTRACE_O_EXITKILL)
+                signal = 0
+            libc.ptrace(PTRACE_CONT, pid, None, signal)
+        elapsed = time.perf_counter() - start
+        process.returncode = os.waitstatus_to_exitcode(status)
+        if process.returncode != 0:
+            raise RuntimeError(f"{' '.join(command)} exited with {process.returncode}")
+        out.seek(0)
+        # Without ptrace (e.g. in a container that forbids it) fall back to the inflated figure.
+        return elapsed, peak if peak is not None else usage.ru_maxrss, out.read()
+
+
+def count_instructions(command):
+    """CPU instructions retired in user space, or None without a usable perf."""
+    perf = shutil.which("perf")
+    if perf is None:
+        return None
+    with tempfile.NamedTemporaryFile(mode="r", suffix=".csv") as report:
+        result = subprocess.run(
+            [perf, "stat", "-x", ",", "-e", "instructions:u", "-o", report.name, "--"] + command,
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+        )
+        if result.returncode != 0:
+            return None
+        for line in report.read().splitlines():
+            fields = line.split(",")
+            if len(fields) > 2 and fields[2].startswith("instructions") and fields[0].isdigit():
+                return int(fields[0])
+    return None
+
+
+def run_benchmark(interpreter, path, runs):
+    # The bytecode cache would turn every run after the first into a load, always compile.
+    command = [interpreter, "--no-cache", path]
+    times = []
+    peak = 0
+    outputs = set()
+    for _ in range(runs):
+        elapsed, rss, output = run_once(command)
+        times.append(elapsed)
+        peak = max(peak, rss)
+        outputs.add(hashlib.sha256(output).hexdigest())
+    if len(outputs) != 1:
+        raise RuntimeError(f"{path} printed different output across runs")
+    return {
+        "median_seconds": statistics.median(times),
+        "seconds": times,
+        "peak_rss_kb": peak,
+        "instructions": count_instructions(command),
+        "output_sha256": outputs.pop(),
+    }
+
+
+def compare(results, baseline, threshold):
+    """Prints each benchmark against the baseline, returns the names that regressed."""
+    regressions = []
+    for name, current in results["benchmarks"].items():
+        old = baseline["benchmarks"].get(name)
+        if old is None:
+            print(f"{name:12} new benchmark, nothing to compare")
+            continue
+        problems = []
+        time_ratio = current["median_seconds"] / old["median_seconds"]
+        if time_ratio > 1 + threshold:
+            problems.append(f"time +{(time_ratio - 1) * 100:.1f}%")
+        memory_ratio = current["peak_rss_kb"] / old["peak_rss_kb"]
+        if memory_ratio > 1 + threshold:
+            problems.append(f"memory +{(memory_ratio - 1) * 100:.1f}%")
+        if current["output_sha256"] != old["output_sha256"]:
+            problems.append("output changed")
+        status = "REGRESSION " + ", ".join(problems) if problems else "ok"
+        print(f"{name:12} time x{time_ratio:.3f}  memory x{memory_ratio:.3f}  {status}")
+        if problems:
+            regressions.append(name)
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--interpreter", required=True, help="clox executable to benchmark")
+    parser.add_argument("--runs", type=int, default=5, help="runs per benchmark (default 5)")
+    parser.add_argument("--output", help="write the JSON report here")
+    parser.add_argument("--compare", metavar="BASELINE", help="JSON report to flag regressions against")
+    parser.add_argument(
+        "--threshold",
+        type=float,
+        default=0.10,
+        help="relative growth counted as a regression (default 0.10)",
+    )
+    parser.add_argument("benchmarks", nargs="*", help="names to run (default: every .lox here)")
+    args = parser.parse_args()
+
+    names = args.benchmarks or sorted(
+        name[: -len(".lox")] for name in os.listdir(BENCH_DIR) if name.endswith(".lox")
+    )
+    results = {"interpreter": os.path.abspath(args.interpreter), "runs": args.runs, "benchmarks": {}}
+    for name in names:
+        result = run_benchmark(args.interpreter, os.path.join(BENCH_DIR, name + ".lox"), args.runs)
+        results["benchmarks"][name] = result
+        instructions = result["instructions"]
+        counted = f"{instructions:>14,} instr" if instructions is not None else ""
+        print(
+            f"{name:12} {result['median_seconds'] * 1000:9.1f} ms  "
+            f"{result['peak_rss_kb']:8} KB {counted}"
+        )
+
+    if args.output:
+        with open(args.output, "w") as file:
+            json.dump(results, file, indent=2)
+            file.write("\n")
+
+    if args.compare:
+        with open(args.compare) as file:
+            baseline = json.load(file)
+        print()
+        if compare(results, baseline, args.threshold):
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,423 @@
+#include "bytecache.h"
+#include "chunk.h"
+#include "memory.h"
+#include "table.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A cache file is a CacheHeader followed by the payload, all integers in the host's byte order:
+//   strings   count, then each string's length and characters
+//   globals   count, then for each slot in order the string index of its name
+//   script    a function record
+// A function record holds the arity, the maximum stack depth, the name's string index or NO_NAME,
+// the code, the line runs, the number of call caches, whether the constants are shared with the
+// script and, if not, the constants. Each constant is a ConstantTag and then a double, a string
+// index or, for a function, its whole record, so nested functions are stored inside their parent.
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t sourceHash;
+	uint64_t sourceLength;
+	uint64_t payloadLength;
+	uint64_t checksum;
+} CacheHeader;
+
+#define CACHE_MAGIC "CLXB"
+#define NO_NAME UINT32_MAX
+
+typedef enum {
+	CONSTANT_NUMBER,
+	CONSTANT_STRING,
+	CONSTANT_FUNCTION,
+} ConstantTag;
+
+// FNV-1a, continuing from `hash` so a hash can be computed over several buffers.
+static uint64_t hashBytes(uint64_t hash, const void *bytes, size_t length) {
+	const uint8_t *at = bytes;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= at[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+#define HASH_SEED 14695981039346656037ull
+
+// Saving.
+
+// Plain malloc'd growable buffer, the collector has no business with it.
+typedef struct {
+	uint8_t *bytes;
+	size_t count;
+	size_t capacity;
+} Buffer;
+
+typedef struct {
+	Buffer strings;
+	Buffer body;
+	int stringCount;
+	// Each string already in the strings section, mapped to its index.
+	Table stringIndex;
+} Writer;
+
+static void writeBytes(Buffer *buffer, const void *bytes, size_t length) {
+	if (buffer->capacity < buffer->count + length) {
+		size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+		while (capacity < buffer->count + length)
+			capacity *= 2;
+		buffer->bytes = realloc(buffer->bytes, capacity);
+		if (buffer->bytes == NULL)
+			exit(1);
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->bytes + buffer->count, bytes, length);
+	buffer->count += length;
+}
+
+static void writeU32(Buffer *buffer, uint32_t value) { writeBytes(buffer, &value, sizeof(value)); }
+
+static void writeU8(Buffer *buffer, uint8_t value) { writeBytes(buffer, &value, sizeof(value)); }
+
+static uint32_t stringIndex(Writer *writer, ObjString *string) {
+	Value index;
+	if (tableGet(&writer->stringIndex, string, &index))
+		return (uint32_t)AS_NUMBER(index);
+	tableSet(&writer->stringIndex, string, NUMBER_VAL(writer->stringCount));
+	writeU32(&writer->strings, (uint32_t)string->length);
+	writeBytes(&writer->strings, string->chars, string->length);
+	return (uint32_t)writer->stringCount++;
+}
+
+// Returns false if the function holds a constant the format can't express.
+static bool writeFunction(Writer *writer, ObjFunction *function) {
+	Buffer *body = &writer->body;
+	writeU32(body, (uint32_t)function->arity);
+	writeU32(body, (uint32_t)function->maxStack);
+	writeU32(body, function->name == NULL ? NO_NAME : stringIndex(writer, function->name));
+	Chunk *chunk = &function->chunk;
+	writeU32(body, (uint32_t)chunk->count);
+	writeBytes(body, chunk->code, chunk->count);
+	writeU32(body, (uint32_t)chunk->lineCount);
+	writeBytes(body, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+	writeU32(body, (uint32_t)chunk->callCacheCount);
+
+	// The script stores a shared pool once.
+	writeU8(body, chunk->constantsOwner != NULL);
+	if (chunk->constantsOwner != NULL)
+		return true;
+	ValueArray *constants = &chunk->constants;
+	writeU32(body, (uint32_t)constants->count);
+	for (int i = 0; i < constants->count; i++) {
+		Value constant = constants->values[i];
+		if (IS_NUMBER(constant)) {
+			double number = AS_NUMBER(constant);
+			writeU8(body, CONSTANT_NUMBER);
+			writeBytes(body, &number, sizeof(number));
+		} else if (IS_STRING(constant)) {
+			writeU8(body, CONSTANT_STRING);
+			writeU32(body, stringIndex(writer, AS_STRING(constant)));
+		} else if (IS_FUNCTION(constant)) {
+			writeU8(body, CONSTANT_FUNCTION);
+			if (!writeFunction(writer, AS_FUNCTION(constant)))
+				return false;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool writeFile(const char *path, Writer *writer, const char *source) {
+	uint32_t stringCount = (uint32_t)writer->stringCount;
+	CacheHeader header;
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = BYTECODE_VERSION;
+	header.sourceLength = strlen(source);
+	header.sourceHash = hashBytes(HASH_SEED, source, header.sourceLength);
+	header.payloadLength = sizeof(stringCount) + writer->strings.count + writer->body.count;
+	uint64_t checksum = hashBytes(HASH_SEED, &stringCount, sizeof(stringCount));
+	checksum = hashBytes(checksum, writer->strings.bytes, writer->strings.count);
+	header.checksum = hashBytes(checksum, writer->body.bytes, writer->body.count);
+
+	// Written next to the cache and renamed over it, so a concurrent run never maps half a file.
+	char temporary[4096];
+	if (snprintf(temporary, sizeof(temporary), "%s.%ld", path, (long)getpid()) >=
+		(int)sizeof(temporary))
+		return false;
+	FILE *file = fopen(temporary, "wb");
+	if (file == NULL)
+		return false;
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+				   fwrite(&stringCount, sizeof(stringCount), 1, file) == 1 &&
+				   fwrite(writer->strings.bytes, 1, writer->strings.count, file) ==
+					   writer->strings.count &&
+				   fwrite(writer->body.bytes, 1, writer->body.count, file) == writer->body.count;
+	written = fclose(file) == 0 && written;
+	if (!written || rename(temporary, path) != 0) {
+		remove(temporary);
+		return false;
+	}
+	return true;
+}
+
+void saveBytecode(const char *path, const char *source, ObjFunction *script) {
+	// Growing the string index can collect, and the script isn't running yet.
+	push(OBJ_VAL(script));
+	Writer writer;
+	memset(&writer, 0, sizeof(writer));
+	initTable(&writer.stringIndex);
+
+	// Slots are handed out in order of first use, so loading registers the names in the same order
+	// and checks it gets the same slots.
+	writeU32(&writer.body, (uint32_t)vm.globalNames.count);
+	for (int i = 0; i < vm.globalNames.count; i++) {
+		writeU32(&writer.body, stringIndex(&writer, AS_STRING(vm.globalNames.values[i])));
+	}
+	if (writeFunction(&writer, script))
+		writeFile(path, &writer, source);
+
+	freeTable(&writer.stringIndex);
+	free(writer.strings.bytes);
+	free(writer.body.bytes);
+	pop();
+}
+
+// Loading.
+
+typedef struct {
+	const uint8_t *at;
+	const uint8_t *end;
+	// Set by the first read past the end, every later read then yields zeros.
+	bool failed;
+	ObjFunction *script;
+	uint32_t stringCount;
+} Reader;
+
+// Every object the loader creates, rooted until the script is handed to the VM. The strings come
+// first, so string index i is loadedObjects.values[i].
+static ValueArray loadedObjects;
+
+static void keepLoaded(Obj *object) {
+	// Growing the array can collect.
+	push(OBJ_VAL(object));
+	writeValueArray(&loadedObjects, OBJ_VAL(object));
+	pop();
+}
+
+// Checks that `count` items of `size` bytes remain, before anything is allocated for them.
+static bool canRead(Reader *reader, size_t count, size_t size) {
+	if (reader->failed || count > (size_t)(reader->end - reader->at) / size)
+		reader->failed = true;
+	return !reader->failed;
+}
+
+static void readBytes(Reader *reader, void *out, size_t length) {
+	if (!canRead(reader, length, 1)) {
+		memset(out, 0, length);
+		return;
+	}
+	memcpy(out, reader->at, length);
+	reader->at += length;
+}
+
+static uint32_t readU32(Reader *reader) {
+	uint32_t value;
+	readBytes(reader, &value, sizeof(value));
+	return value;
+}
+
+static uint8_t readU8(Reader *reader) {
+	uint8_t value;
+	readBytes(reader, &value, sizeof(value));
+	return value;
+}
+
+static ObjString *stringAt(Reader *reader, uint32_t index) {
+	if (reader->failed || index >= reader->stringCount) {
+		reader->failed = true;
+		return NULL;
+	}
+	return AS_STRING(loadedObjects.values[index]);
+}
+
+static ObjString *readString(Reader *reader) { return stringAt(reader, readU32(reader)); }
+
+static ObjFunction *readFunction(Reader *reader) {
+	ObjFunction *function = newFunction();
+	keepLoaded((Obj *)function);
+	if (reader->script == NULL)
+		reader->script = function;
+	function->arity = (int)readU32(reader);
+	function->maxStack = (int)readU32(reader);
+	uint32_t name = readU32(reader);
+	if (name != NO_NAME)
+		function->name = stringAt(reader, name);
+
+	// The chunk is visible to the collector throughout, so each array is filled before it is
+	// attached to the chunk.
+	Chunk *chunk = &function->chunk;
+	uint32_t count = readU32(reader);
+	if (!canRead(reader, count, 1))
+		return NULL;
+	uint8_t *code = ALLOCATE(uint8_t, count);
+	readBytes(reader, code, count);
+	chunk->code = code;
+	chunk->count = chunk->capacity = (int)count;
+
+	count = readU32(reader);
+	if (!canRead(reader, count, sizeof(LineStart)))
+		return NULL;
+	LineStart *lines = ALLOCATE(LineStart, count);
+	readBytes(reader, lines, sizeof(LineStart) * count);
+	chunk->lines = lines;
+	chunk->lineCount = chunk->lineCapacity = (int)count;
+
+	// Call sites are numbered by a 16-bit operand.
+	count = readU32(reader);
+	if (count > UINT16_MAX + 1) {
+		reader->failed = true;
+		return NULL;
+	}
+	CallCache *callCaches = ALLOCATE(CallCache, count);
+	for (uint32_t i = 0; i < count; i++) {
+		callCaches[i].callee = NULL;
+	}
+	chunk->callCaches = callCaches;
+	chunk->callCacheCount = chunk->callCacheCapacity = (int)count;
+
+	if (readU8(reader)) {
+		// The script's pool is aliased once it is complete, see readCache().
+		if (function == reader->script) {
+			reader->failed = true;
+			return NULL;
+		}
+		chunk->constantsOwner = (Obj *)reader->script;
+		return function;
+	}
+	// Constants are addressed by a one byte operand.
+	count = readU32(reader);
+	if (count > UINT8_MAX + 1) {
+		reader->failed = true;
+		return NULL;
+	}
+	ValueArray *constants = &chunk->constants;
+	constants->values = ALLOCATE(Value, count);
+	constants->capacity = (int)count;
+	for (uint32_t i = 0; i < count && !reader->failed; i++) {
+		Value constant = NIL_VAL;
+		switch (readU8(reader)) {
+		case CONSTANT_NUMBER: {
+			double number;
+			readBytes(reader, &number, sizeof(number));
+			constant = NUMBER_VAL(number);
+			break;
+		}
+		case CONSTANT_STRING: {
+			ObjString *string = readString(reader);
+			if (string != NULL)
+				constant = OBJ_VAL(string);
+			break;
+		}
+		case CONSTANT_FUNCTION: {
+			ObjFunction *nested = readFunction(reader);
+			if (nested != NULL)
+				constant = OBJ_VAL(nested);
+			break;
+		}
+		default:
+			reader->failed = true;
+		}
+		constants->values[constants->count++] = constant;
+	}
+	return reader->failed ? NULL : function;
+}
+
+static ObjFunction *readCache(const uint8_t *bytes, size_t size, const char *source) {
+	CacheHeader header;
+	memcpy(&header, bytes, sizeof(header));
+	size_t sourceLength = strlen(source);
+	if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != BYTECODE_VERSION || header.sourceLength != sourceLength ||
+		header.payloadLength != size - sizeof(header) ||
+		header.sourceHash != hashBytes(HASH_SEED, source, sourceLength)) {
+		return NULL;
+	}
+	Reader reader;
+	reader.at = bytes + sizeof(header);
+	reader.end = bytes + size;
+	reader.failed = false;
+	reader.script = NULL;
+	if (header.checksum != hashBytes(HASH_SEED, reader.at, header.payloadLength))
+		return NULL;
+
+	// String fixups: every string the code refers to is interned again in this VM, and constants
+	// refer to it by its position in the strings section.
+	uint32_t stringCount = readU32(&reader);
+	if (!canRead(&reader, stringCount, sizeof(uint32_t)))
+		return NULL;
+	for (uint32_t i = 0; i < stringCount; i++) {
+		uint32_t length = readU32(&reader);
+		if (!canRead(&reader, length, 1))
+			return NULL;
+		keepLoaded((Obj *)copyString((const char *)reader.at, (int)length));
+		reader.at += length;
+	}
+	reader.stringCount = stringCount;
+
+	// Global slots are baked into the code, the VM has to hand out the very same ones.
+	uint32_t globalCount = readU32(&reader);
+	for (uint32_t slot = 0; slot < globalCount; slot++) {
+		ObjString *name = readString(&reader);
+		if (name == NULL || globalSlot(name) != (int)slot)
+			return NULL;
+	}
+
+	ObjFunction *script = readFunction(&reader);
+	if (script == NULL || reader.at != reader.end)
+		return NULL;
+	// With a shared pool every function of the script is one of the script's constants.
+	ValueArray *pool = &script->chunk.constants;
+	for (int i = 0; i < pool->count; i++) {
+		if (!IS_FUNCTION(pool->values[i]))
+			continue;
+		ObjFunction *function = AS_FUNCTION(pool->values[i]);
+		if (function->chunk.constantsOwner != NULL)
+			function->chunk.constants = *pool;
+	}
+	return script;
+}
+
+ObjFunction *loadBytecode(const char *path, const char *source) {
+	int file = open(path, O_RDONLY);
+	if (file < 0)
+		return NULL;
+	struct stat status;
+	if (fstat(file, &status) != 0 || (size_t)status.st_size < sizeof(CacheHeader)) {
+		close(file);
+		return NULL;
+	}
+	size_t size = (size_t)status.st_size;
+	void *bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (bytes == MAP_FAILED)
+		return NULL;
+
+	ObjFunction *script = readCache(bytes, size, source);
+	munmap(bytes, size);
+	// Whatever didn't make it into the script is garbage now.
+	freeValueArray(&loadedObjects);
+	return script;
+}
+
+void markBytecodeRoots() {
+	for (int i = 0; i < loadedObjects.count; i++) {
+		markValue(loadedObjects.values[i]);
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef clox_bytecache_h
+#define clox_bytecache_h
+
+#include "object.h"
+
+// Bump whenever the bytecode or the cache layout changes meaning, so stale caches are recompiled.
+#define BYTECODE_VERSION 3
+
+// Returns the script stored in the cache file at `path` if this build wrote it while compiling
+// exactly `source`. Returns NULL when the file is missing, stale or damaged, the caller then
+// compiles as usual.
+ObjFunction *loadBytecode(const char *path, const char *source);
+// Stores a freshly compiled script in the cache file at `path`. The cache is only an optimization,
+// failing to write it is silently ignored.
+void saveBytecode(const char *path, const char *source, ObjFunction *script);
+// Objects created while loading a cache aren't reachable from the VM until the script runs, so the
+// collector asks the loader for them.
+void markBytecodeRoots();
+
+#endif
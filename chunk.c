@@ -1,18 +1,38 @@
 #include "chunk.h"
 #include "memory.h"
 #include "value.h"
+#include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   // Start off completely empty
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
   // If we initialize it here, then who's responsible for its lifetime;
   // Why do we need to pass the pointer to the chunk
   initValueArray(&chunk->constants);
+  chunk->callCacheCount = 0;
+  chunk->callCacheCapacity = 0;
+  chunk->callCaches = NULL;
+  chunk->arena = NULL;
+  chunk->constantsOwner = NULL;
+}
+
+// Every array of a chunk grows through here, so a chunk that is still being compiled takes its
+// memory from the compile session's arena.
+#define CHUNK_GROW_ARRAY(chunk, type, pointer, oldCount, newCount)                                 \
+  (type *)chunkReallocate(chunk, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+
+static void *chunkReallocate(Chunk *chunk, void *pointer, size_t oldSize, size_t newSize) {
+  if (chunk->arena != NULL)
+    return arenaReallocate(chunk->arena, pointer, oldSize, newSize);
+  return reallocate(pointer, oldSize, newSize);
 }
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line) {
@@ -21,30 +41,250 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
     // Does this copy the capacity?
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
-    chunk->code =
-        GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+    chunk->code = CHUNK_GROW_ARRAY(chunk, uint8_t, chunk->code, oldCapacity,
+                                   chunk->capacity);
   }
   // If not grow the array to make room
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
+
+  // The compiler truncates chunks when it folds constants, runs that started in the dropped code
+  // are gone.
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= chunk->count)
+    chunk->lineCount--;
+  if (chunk->lineCount == 0 || chunk->lines[chunk->lineCount - 1].line != line) {
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+      int oldCapacity = chunk->lineCapacity;
+      chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+      chunk->lines = CHUNK_GROW_ARRAY(chunk, LineStart, chunk->lines, oldCapacity,
+                                      chunk->lineCapacity);
+    }
+    chunk->lines[chunk->lineCount++] = (LineStart){chunk->count, line};
+  }
   chunk->count++;
 }
 
+int getLine(Chunk *chunk, int offset) {
+  // Binary search for the last run starting at or before offset.
+  int low = 0;
+  int high = chunk->lineCount - 1;
+  while (low < high) {
+    int mid = low + (high - low + 1) / 2;
+    if (chunk->lines[mid].offset <= offset)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+  return chunk->lineCount == 0 ? 0 : chunk->lines[low].line;
+}
+
 void freeChunk(Chunk *chunk) {
   // I guess we're freeing the entire memory. Why does it care to know the whole
   // capacity?
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(uint8_t, chunk->lines, chunk->capacity);
-  freeValueArray(&chunk->constants);
+  // Arena memory is only ever released with the whole arena.
+  if (chunk->arena == NULL) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    if (chunk->constantsOwner == NULL)
+      freeValueArray(&chunk->constants);
+    FREE_ARRAY(CallCache, chunk->callCaches, chunk->callCacheCapacity);
+  }
   initChunk(chunk);
   // Use the same reallocate function with a different macro
 }
 
+// Copies an arena-backed array into a heap block of exactly `count` elements.
+#define COPY_OUT(type, pointer, count)                                                             \
+  (type *)copyOut(pointer, sizeof(type) * (count))
+
+static void *copyOut(void *pointer, size_t size) {
+  void *result = reallocate(NULL, 0, size);
+  if (size > 0)
+    memcpy(result, pointer, size);
+  return result;
+}
+
+void finalizeChunk(Chunk *chunk) {
+  if (chunk->arena == NULL)
+    return;
+  // Each copy can trigger a collection, which reads the constants, so the chunk stays fully
+  // usable throughout: every array is swapped in one assignment.
+  chunk->code = COPY_OUT(uint8_t, chunk->code, chunk->count);
+  chunk->capacity = chunk->count;
+  chunk->lines = COPY_OUT(LineStart, chunk->lines, chunk->lineCount);
+  chunk->lineCapacity = chunk->lineCount;
+  // A shared pool is copied out with its owner.
+  if (chunk->constantsOwner == NULL) {
+    ValueArray *constants = &chunk->constants;
+    constants->values = COPY_OUT(Value, constants->values, constants->count);
+    constants->capacity = constants->count;
+  }
+  chunk->callCaches = COPY_OUT(CallCache, chunk->callCaches, chunk->callCacheCount);
+  chunk->callCacheCapacity = chunk->callCacheCount;
+  chunk->arena = NULL;
+}
+
 int addConstant(Chunk *chunk, Value value) {
   // Store the value in the value array
   // Return the position in the array
   ValueArray *values = &chunk->constants;
-  writeValueArray(values, value);
+  // Keep the value reachable in case growing the array triggers a collection.
+  push(value);
+  // Same growth as writeValueArray(), but through the chunk's arena.
+  if (values->capacity < values->count + 1) {
+    int oldCapacity = values->capacity;
+    values->capacity = GROW_CAPACITY(oldCapacity);
+    values->values = CHUNK_GROW_ARRAY(chunk, Value, values->values, oldCapacity,
+                                      values->capacity);
+  }
+  values->values[values->count++] = value;
+  pop();
+  // Constant pools aren't scanned by minor collections.
+  if (IS_YOUNG_VALUE(value))
+    rememberSlot(values, values->count - 1);
   return (*values).count - 1;
 }
+
+int addCallCache(Chunk *chunk) {
+	if (chunk->callCacheCapacity < chunk->callCacheCount + 1) {
+		int oldCapacity = chunk->callCacheCapacity;
+		chunk->callCacheCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->callCaches =
+			CHUNK_GROW_ARRAY(chunk, CallCache, chunk->callCaches, oldCapacity,
+							 chunk->callCacheCapacity);
+	}
+	chunk->callCaches[chunk->callCacheCount].callee = NULL;
+	return chunk->callCacheCount++;
+}
+
+int instructionLength(uint8_t instruction) {
+	switch (instruction) {
+	case OP_CALL:
+	case OP_TAIL_CALL:
+		return 4;
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_LOOP:
+	case OP_GET_GLOBAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_ADD_LOCALS:
+	case OP_LESS_JUMP_IF_FALSE:
+		return 3;
+	case OP_CONSTANT:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_ADD_CONSTANT:
+	case OP_SET_LOCAL_POP:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+OpCode genericOpcode(uint8_t instruction) {
+	switch (instruction) {
+	case OP_ADD_NUM:
+	case OP_ADD_STR:
+		return OP_ADD;
+	case OP_EQUAL_NUM:
+		return OP_EQUAL;
+	default:
+		return instruction;
+	}
+}
+
+int instructionStackEffect(Chunk *chunk, int offset) {
+	switch (genericOpcode(chunk->code[offset])) {
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_GLOBAL:
+	case OP_ADD_LOCALS:
+		return 1;
+	case OP_POP:
+	case OP_DEFINE_GLOBAL:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_PRINT:
+	case OP_SET_LOCAL_POP:
+	case OP_RETURN:
+		return -1;
+	case OP_LESS_JUMP_IF_FALSE:
+		return -2;
+	case OP_CALL:
+	case OP_TAIL_CALL:
+		// The callee and its arguments are replaced by the result.
+		return -chunk->code[offset + 1];
+	default:
+		return 0;
+	}
+}
+
+static int jumpTarget(Chunk *chunk, int offset) {
+	uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+	if (chunk->code[offset] == OP_LOOP)
+		return offset + 3 - jump;
+	return offset + 3 + jump;
+}
+
+int *stackDepths(Chunk *chunk, int depth) {
+	int count = chunk->count;
+	// Every offset is queued at most once, when its depth is first known.
+	int *depthAt = ALLOCATE(int, count);
+	int *worklist = ALLOCATE(int, count);
+	for (int i = 0; i < count; i++) {
+		depthAt[i] = -1;
+	}
+	int pending = 0;
+	if (count > 0) {
+		depthAt[0] = depth;
+		worklist[pending++] = 0;
+	}
+	while (pending > 0) {
+		int offset = worklist[--pending];
+		uint8_t instruction = chunk->code[offset];
+		int after = depthAt[offset] + instructionStackEffect(chunk, offset);
+		int successors[2];
+		int successorCount = 0;
+		if (instruction == OP_JUMP || instruction == OP_LOOP) {
+			successors[successorCount++] = jumpTarget(chunk, offset);
+		} else if (instruction == OP_JUMP_IF_FALSE || instruction == OP_LESS_JUMP_IF_FALSE) {
+			successors[successorCount++] = jumpTarget(chunk, offset);
+			successors[successorCount++] = offset + instructionLength(instruction);
+		} else if (instruction != OP_RETURN) {
+			successors[successorCount++] = offset + instructionLength(instruction);
+		}
+		for (int i = 0; i < successorCount; i++) {
+			int next = successors[i];
+			if (next >= 0 && next < count && depthAt[next] == -1) {
+				depthAt[next] = after;
+				worklist[pending++] = next;
+			}
+		}
+	}
+	FREE_ARRAY(int, worklist, count);
+	return depthAt;
+}
+
+int maxStackDepth(Chunk *chunk, int depth) {
+	int *depthAt = stackDepths(chunk, depth);
+	int maxDepth = depth;
+	for (int offset = 0; offset < chunk->count; offset++) {
+		// The deepest point is right after some instruction.
+		if (depthAt[offset] != -1) {
+			int after = depthAt[offset] + instructionStackEffect(chunk, offset);
+			if (after > maxDepth)
+				maxDepth = after;
+		}
+	}
+	FREE_ARRAY(int, depthAt, chunk->count);
+	return maxDepth;
+}
@@ -1,6 +1,7 @@
 #ifndef clox_chunk_h
 #define clox_chunk_h
 
+#include "arena.h"
 #include "common.h"
 #include "value.h"
 
@@ -31,29 +32,122 @@ typedef enum {
 	OP_JUMP_IF_FALSE,
 	OP_LOOP,
 	OP_RETURN,
+	// OP_CALL whose result is returned straight away, the callee reuses the caller's frame.
+	OP_TAIL_CALL,
+	// Superinstructions. The compiler never emits these directly, they are produced by
+	// optimizeChunk() fusing common sequences once a function has been compiled.
+	OP_ADD_LOCALS,		   // OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD
+	OP_LESS_JUMP_IF_FALSE, // OP_LESS, OP_JUMP_IF_FALSE, OP_POP
+	OP_ADD_CONSTANT,	   // OP_CONSTANT, OP_ADD
+	OP_SET_LOCAL_POP,	   // OP_SET_LOCAL, OP_POP
+	// Quickened instructions. run() rewrites a generic instruction in place into one of these once
+	// it has seen the operand types, and back again when a later execution sees other types.
+	OP_ADD_NUM,	  // OP_ADD of two numbers
+	OP_ADD_STR,	  // OP_ADD of two strings or ropes
+	OP_EQUAL_NUM, // OP_EQUAL of two numbers
 } OpCode;
 
+// Three-address instruction set run by the register backend. Every instruction is
+// REG_INSTRUCTION_SIZE bytes: the opcode then operands A, B and C. Registers are the slots of the
+// frame's window on the value stack, so locals are registers and temporaries sit above them.
+// Jump offsets are signed 16-bit values stored in B (high byte) and C, relative to the next
+// instruction.
+typedef enum {
+	ROP_MOVE,		   // R[A] = R[B]
+	ROP_LOADK,		   // R[A] = K[B]
+	ROP_LOADNIL,	   // R[A] = nil
+	ROP_LOADTRUE,	   // R[A] = true
+	ROP_LOADFALSE,	   // R[A] = false
+	ROP_GET_GLOBAL,	   // R[A] = globals[BC]
+	ROP_DEFINE_GLOBAL, // globals[BC] = R[A]
+	ROP_SET_GLOBAL,	   // globals[BC] = R[A], the global must already exist
+	ROP_EQUAL,		   // R[A] = R[B] == R[C]
+	ROP_GREATER,	   // R[A] = R[B] > R[C]
+	ROP_LESS,		   // R[A] = R[B] < R[C]
+	ROP_ADD,		   // R[A] = R[B] + R[C]
+	ROP_ADD_CONSTANT,  // R[A] = R[B] + K[C]
+	ROP_SUBTRACT,	   // R[A] = R[B] - R[C]
+	ROP_MULTIPLY,	   // R[A] = R[B] * R[C]
+	ROP_DIVIDE,		   // R[A] = R[B] / R[C]
+	ROP_NOT,		   // R[A] = !R[B]
+	ROP_NEGATE,		   // R[A] = -R[B]
+	ROP_PRINT,		   // print R[A]
+	ROP_JUMP,		   // ip += BC
+	ROP_JUMP_IF_FALSE, // if R[A] is falsey: ip += BC
+	ROP_LESS_JUMP,	   // if !(R[A] < R[B]): take the ROP_JUMP that follows, else skip it
+	ROP_CALL,		   // R[A] = R[A](R[A+1] ... R[A+B])
+	ROP_TAIL_CALL,	   // return R[A](R[A+1] ... R[A+B]), reusing the frame
+	ROP_RETURN,		   // return R[A]
+} RegOpCode;
+
+#define REG_INSTRUCTION_SIZE 4
+
+// Monomorphic inline cache for one OP_CALL site. It remembers the last callee that passed the
+// type and arity checks, so a call that sees the same object again can set up its frame directly.
+typedef struct {
+	Obj *callee;
+} CallCache;
+
+// Start of a run of bytecode generated from the same source line.
+typedef struct {
+	int offset;
+	int line;
+} LineStart;
+
 // Wrapper around an array of bytes
 // We need dynamic arrays
 typedef struct {
 	int count;
 	int capacity;
 	uint8_t *code;
-	int *lines;
+	// Run-length encoded line numbers, one entry each time the line changes. Use getLine().
+	int lineCount;
+	int lineCapacity;
+	LineStart *lines;
 	// This is a sub dynamic array inside this main one.
 	// Here we can create arbitrarily nested data structures.
 	// We store all the constants we need.
 	// Note that ValueArray is a struct, not a pointer to a struct.
 	ValueArray constants;
+	// One cache per OP_CALL, indexed by the call's second operand.
+	int callCacheCount;
+	int callCacheCapacity;
+	CallCache *callCaches;
+	// Set while the compiler is building the chunk, its arrays then live in this arena.
+	Arena *arena;
+	// With SHARED_CONSTANTS, the function whose chunk owns `constants`. This chunk's copy of the
+	// array header aliases the owner's and is never freed through it. NULL when the chunk owns
+	// them.
+	struct Obj *constantsOwner;
 } Chunk;
 
 // This will be a function to construct a chunk
 // C doesn't have constructors
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
+// Moves a chunk's arrays out of its arena into exactly sized heap blocks.
+void finalizeChunk(Chunk *chunk);
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 // We define a shortcut for double in value, that we use here.
 // Later the type of a constant will be exp[andedfhhh
 int addConstant(Chunk *chunk, Value value);
+// Source line of the byte at offset.
+int getLine(Chunk *chunk, int offset);
+// Reserves an empty inline cache for a new call site and returns its index.
+int addCallCache(Chunk *chunk);
+// Number of bytes taken by an instruction including its operands.
+int instructionLength(uint8_t instruction);
+// The instruction a quickened one was rewritten from, any other instruction unchanged. Passes that
+// read code which has already run see the generic instruction through this.
+OpCode genericOpcode(uint8_t instruction);
+// How many values the instruction at offset leaves on the stack compared to before it runs.
+// For jumps this is the effect along both the taken and the fall-through edge.
+int instructionStackEffect(Chunk *chunk, int offset);
+// Stack depth before each instruction when the chunk starts `depth` values deep, following both
+// edges of every jump. -1 for offsets that aren't reached, e.g. inside an instruction. The array
+// has chunk->count entries and is freed with FREE_ARRAY.
+int *stackDepths(Chunk *chunk, int depth);
+// Deepest the stack gets while running the chunk, starting `depth` values deep.
+int maxStackDepth(Chunk *chunk, int depth);
 #endif
@@ -11,6 +11,30 @@
 #define DEBUG_PRINT_CODE
 #endif
 
+// Counts opcodes, opcode pairs and the ticks spent in each opcode, see profile.h.
+#ifdef BUILD_D
+#define PROFILE_OPCODES
+#endif
+
+// run() threads its dispatch through a table of label addresses when the compiler supports
+// labels-as-values (GCC and Clang). Tracing needs a single loop head to print from, so it and the
+// COMPUTED_GOTO=OFF CMake option fall back to the portable switch.
+#if defined(__GNUC__) && !defined(DEBUG_TRACE_EXECUTION) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Hot functions are compiled to x86-64 machine code, see jit.h. Tracing and the opcode profiler
+// need every instruction to go through run(), and JIT=OFF in CMake benchmarks without it.
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT) &&                             \
+	!defined(DEBUG_TRACE_EXECUTION) && !defined(PROFILE_OPCODES)
+#define JIT
+#endif
+
+// DEBUG_STRESS_GC collects on every allocation, DEBUG_LOG_GC traces each collection.
+// #define DEBUG_LOG_GC
+
+// NAN_BOXING is set by the NAN_BOXING CMake option, see value.h for both layouts.
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #include <stdbool.h>
@@ -1,9 +1,13 @@
 #include "compiler.h"
 #include "chunk.h"
 #include "common.h"
+#include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "value.h"
+#include "vm.h"
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,6 +48,22 @@ typedef struct {
 
 typedef enum { TYPE_FUNCTION, TYPE_SCRIPT } FunctionType;
 
+// How many recent constant loads the compiler remembers for folding. `1 + 2 * 3` needs the `1`
+// once `2 * 3` has been folded, so this bounds how deeply nested a foldable expression can be.
+#define CONSTANT_LOADS_MAX 8
+
+// Slots in the compile-time index from constant values to their position in the constant table.
+// Twice the 256 constants a table can address keeps probe sequences short.
+#define CONSTANT_INDEX_SIZE 512
+
+// Code range of an instruction that just loads a constant (OP_CONSTANT, OP_NIL, OP_TRUE, OP_FALSE).
+typedef struct {
+	int start;
+	int end;
+	// Whether the load added its constant to the table rather than reusing an existing one.
+	bool fresh;
+} ConstantLoad;
+
 typedef struct Compiler {
 	struct Compiler *enclosing;
 	ObjFunction *function;
@@ -56,10 +76,23 @@ typedef struct Compiler {
 	Local locals[UINT8_COUNT];
 	int localCount;
 	int scopeDepth;
+	// The most recent constant loads, newest last. When an operator's operands are exactly some of
+	// these, it is evaluated at compile time, see constantOperand().
+	ConstantLoad constantLoads[CONSTANT_LOADS_MAX];
+	int constantLoadCount;
+	// Position + 1 of each constant in this function's constant table, 0 for an unused slot, so
+	// makeConstant() can reuse an equal constant. With SHARED_CONSTANTS only the script's is used.
+	int16_t constantIndex[CONSTANT_INDEX_SIZE];
+	// Highest offset any jump lands on. Code before it can't be rewritten, a jump may depend on it.
+	int lastJumpTarget;
+	// Offset of the most recent OP_CALL, -1 before the first.
+	int lastCall;
 } Compiler;
 
 Parser parser;
 Compiler *current = NULL;
+// Backs the chunks of every function compiled by one compile() call, until they are finalized.
+static Arena compileArena;
 
 static Chunk *currentChunk() { return &current->function->chunk; }
 
@@ -139,6 +172,8 @@ static void emitLoop(int loopStart) {
 	// and by the time this op code comes around, we can write it and its operand at once without
 	// patching.
 	emitByte(OP_LOOP);
+	if (loopStart > current->lastJumpTarget)
+		current->lastJumpTarget = loopStart;
 
 	int offset = currentChunk()->count - loopStart + 2;
 	if (offset > UINT16_MAX)
@@ -160,16 +195,158 @@ static void emitReturn() {
 	// Possibly for closures to hoist any captured variables
 	emitByte(OP_RETURN);
 }
+// The compiler whose chunk holds the constant table the current function's code refers to.
+static Compiler *poolCompiler() {
+#ifdef SHARED_CONSTANTS
+	Compiler *compiler = current;
+	while (compiler->enclosing != NULL)
+		compiler = compiler->enclosing;
+	return compiler;
+#else
+	return current;
+#endif
+}
+
+static ValueArray *constantPool() { return &poolCompiler()->function->chunk.constants; }
+
+// Constants are only merged when they are indistinguishable: the same bits for numbers, so 0 and
+// -0 stay apart, and the same object otherwise, which covers interned strings.
+static bool sameConstant(Value a, Value b) {
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		double x = AS_NUMBER(a);
+		double y = AS_NUMBER(b);
+		return memcmp(&x, &y, sizeof(double)) == 0;
+	}
+	return IS_OBJ(a) && IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b);
+}
+
+static uint32_t constantHash(Value value) {
+	uint64_t bits;
+	if (IS_NUMBER(value)) {
+		double number = AS_NUMBER(value);
+		memcpy(&bits, &number, sizeof(bits));
+	} else {
+		bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+	}
+	// Mix the high bits down, numbers and pointers differ mostly at the top and bottom.
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdull;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
 static uint8_t makeConstant(Value value) {
-	int constant = addConstant(currentChunk(), value);
+	Compiler *pool = poolCompiler();
+	ValueArray *constants = &pool->function->chunk.constants;
+	// Every function is its own constant, looking them up would only fill the index.
+	bool indexed = !IS_FUNCTION(value);
+	int freeSlot = -1;
+	if (indexed) {
+		uint32_t slot = constantHash(value) & (CONSTANT_INDEX_SIZE - 1);
+		for (int probes = 0; probes < CONSTANT_INDEX_SIZE; probes++) {
+			int index = pool->constantIndex[slot] - 1;
+			if (index < 0) {
+				if (freeSlot < 0)
+					freeSlot = slot;
+				break;
+			}
+			// Constant folding gives back the newest constants, so an entry can point past the
+			// end of the table. It is reused, but the probe carries on past it.
+			if (index >= constants->count) {
+				if (freeSlot < 0)
+					freeSlot = slot;
+			} else if (sameConstant(constants->values[index], value)) {
+				return (uint8_t)index;
+			}
+			slot = (slot + 1) & (CONSTANT_INDEX_SIZE - 1);
+		}
+	}
+
+	int constant = addConstant(&pool->function->chunk, value);
 	if (constant > UINT8_MAX) {
 		error("Too many constants in one chunk");
 		return 0;
 	}
+	if (freeSlot >= 0)
+		pool->constantIndex[freeSlot] = (int16_t)(constant + 1);
 	return (uint8_t)constant;
 }
 
-static void emitConstant(Value value) { emitBytes(OP_CONSTANT, makeConstant(value)); }
+// Remembers that the code from `start` to the end of the chunk loads a single constant.
+static void recordConstant(int start, bool fresh) {
+	if (current->constantLoadCount == CONSTANT_LOADS_MAX) {
+		// Forget the oldest one.
+		memmove(current->constantLoads, current->constantLoads + 1,
+				sizeof(ConstantLoad) * (CONSTANT_LOADS_MAX - 1));
+		current->constantLoadCount--;
+	}
+	current->constantLoads[current->constantLoadCount++] =
+		(ConstantLoad){start, currentChunk()->count, fresh};
+}
+
+static void emitConstant(Value value) {
+	int start = currentChunk()->count;
+	int poolSize = constantPool()->count;
+	emitBytes(OP_CONSTANT, makeConstant(value));
+	recordConstant(start, constantPool()->count > poolSize);
+}
+
+// If the code ending at `end` is one of the recent constant loads, stores its offset in *start and
+// its value in *value. It must also start at or after the last jump target: the operand of `(a and
+// 1) + 2` ends in a constant load, but the jump that skips it lands right after it.
+static bool constantOperand(int end, int *start, Value *value) {
+	for (int i = current->constantLoadCount - 1; i >= 0; i--) {
+		ConstantLoad *load = &current->constantLoads[i];
+		if (load->end != end || load->start < current->lastJumpTarget)
+			continue;
+		Chunk *chunk = currentChunk();
+		switch (chunk->code[load->start]) {
+		case OP_CONSTANT:
+			*value = constantPool()->values[chunk->code[load->start + 1]];
+			break;
+		case OP_NIL:
+			*value = NIL_VAL;
+			break;
+		case OP_TRUE:
+			*value = BOOL_VAL(true);
+			break;
+		case OP_FALSE:
+			*value = BOOL_VAL(false);
+			break;
+		default:
+			return false;
+		}
+		*start = load->start;
+		return true;
+	}
+	return false;
+}
+
+// Drops the operands' code from `start` on and loads `value` in their place. Booleans and nil use
+// their dedicated instructions like literals do.
+static void replaceWithConstant(int start, Value value) {
+	// The dropped code is just the operands' loads. Constants they added are the newest entries of
+	// the table and nothing else refers to them yet, so those are handed back and folding doesn't
+	// use up the 256 slots. Reused constants stay, other code loads them too.
+	Chunk *chunk = currentChunk();
+	ValueArray *constants = constantPool();
+	while (current->constantLoadCount > 0 &&
+		   current->constantLoads[current->constantLoadCount - 1].end > start) {
+		ConstantLoad *load = &current->constantLoads[--current->constantLoadCount];
+		if (load->fresh && chunk->code[load->start + 1] == constants->count - 1)
+			constants->count--;
+	}
+	chunk->count = start;
+	if (IS_BOOL(value)) {
+		emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	} else if (IS_NIL(value)) {
+		emitByte(OP_NIL);
+	} else {
+		emitConstant(value);
+		return;
+	}
+	recordConstant(start, false);
+}
 static void patchJump(int offset) {
 	// The offset will be from before compiling the statement.
 	int jump = currentChunk()->count - offset - 2;
@@ -186,6 +363,7 @@ static void patchJump(int offset) {
 	// = 0 0 0 0 0 0 0 0 0 1 0 1 0 1 0 1
 	currentChunk()->code[offset] = (jump >> 8) & 0xff;
 	currentChunk()->code[offset + 1] = jump & 0xff;
+	current->lastJumpTarget = currentChunk()->count;
 }
 static void initCompiler(Compiler *compiler, FunctionType type) {
 	compiler->enclosing = current;
@@ -193,8 +371,17 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
 	compiler->type = type;
 	compiler->localCount = 0;
 	compiler->scopeDepth = 0;
+	compiler->constantLoadCount = 0;
+	compiler->lastCall = -1;
+	memset(compiler->constantIndex, 0, sizeof(compiler->constantIndex));
+	compiler->lastJumpTarget = 0;
 	compiler->function = newFunction();
+	compiler->function->chunk.arena = &compileArena;
 	current = compiler;
+#ifdef SHARED_CONSTANTS
+	if (compiler->enclosing != NULL)
+		compiler->function->chunk.constantsOwner = (Obj *)poolCompiler()->function;
+#endif
 	if (type != TYPE_SCRIPT) {
 		current->function->name = copyString(parser.previous.start, parser.previous.length);
 	}
@@ -206,9 +393,21 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
 static ObjFunction *endCompiler() {
 	emitReturn();
 	ObjFunction *function = current->function;
+#ifndef NO_PEEPHOLE
+	// Jumps may still hold placeholder offsets after an error, so only optimize good code.
+	if (!parser.hadError) {
+		optimizeChunk(currentChunk());
+	}
+#endif
+	// The callee and its arguments are on the stack when the body starts.
+	if (!parser.hadError)
+		function->maxStack = maxStackDepth(currentChunk(), function->arity + 1);
 
 #ifdef DEBUG_PRINT_CODE
 	if (!parser.hadError) {
+		// A function sharing the script's pool doesn't see it until it is finalized.
+		if (currentChunk()->constantsOwner != NULL)
+			currentChunk()->constants = *constantPool();
 		disassembleChunk(currentChunk(),
 						 function->name != NULL ? function->name->chars : "<script>");
 	}
@@ -250,8 +449,22 @@ static void block() {
 	}
 	consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
-static uint8_t identifierConstant(Token *name) {
-	return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+// Globals are resolved to a slot in vm.globalValues while compiling, so the VM indexes an array
+// instead of hashing the name on every access. The same name always gets the same slot, which
+// keeps slots stable across REPL lines.
+static uint16_t identifierGlobal(Token *name) {
+	int slot = globalSlot(copyString(name->start, name->length));
+	if (slot > UINT16_MAX) {
+		error("Too many global variables.");
+		return 0;
+	}
+	return (uint16_t)slot;
+}
+
+static void emitGlobal(uint8_t instruction, uint16_t slot) {
+	emitByte(instruction);
+	emitByte((slot >> 8) & 0xff);
+	emitByte(slot & 0xff);
 }
 static bool identifiersEqual(Token *a, Token *b) {
 	if (a->length != b->length)
@@ -305,17 +518,17 @@ static void declareVariable() {
 	}
 	addLocal(*name);
 }
-static uint8_t parseVariable(const char *errorMessage) {
+static uint16_t parseVariable(const char *errorMessage) {
 	consume(TOKEN_IDENTIFIER, errorMessage);
 	declareVariable();
 	// We are not interested in local variables here
 	// Locals are looked up by index rather than name at runtime
 	if (current->scopeDepth > 0)
 		return 0;
-	// Global variable names will get written to the constants table here
+	// Global variable names get a slot in the VM's globals array here
 	// The value of the global won't be written as they are lazily evaluated.
-	// It then returns the index of that constant in the constant table.
-	return identifierConstant(&parser.previous);
+	// It then returns the index of that slot.
+	return identifierGlobal(&parser.previous);
 }
 
 static void markInitialized() {
@@ -326,7 +539,7 @@ static void markInitialized() {
 	// Local should live at the localsCount index of the array - 1
 	current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
 	// In the VM, the stack top will have the value on the RHS of the assignment
 	// So we don't need to do anything as the variable will be right where it needs to be
 	// The compiler will have pointed the bytecode here
@@ -337,7 +550,7 @@ static void defineVariable(uint8_t global) {
 		markInitialized();
 		return;
 	}
-	emitBytes(OP_DEFINE_GLOBAL, global);
+	emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 static void function(FunctionType type) {
@@ -352,7 +565,7 @@ static void function(FunctionType type) {
 			if (current->function->arity > 255) {
 				errorAtCurrent("Can't have more than 255 parameters.");
 			}
-			uint8_t constant = parseVariable("Expect parameter name");
+			uint16_t constant = parseVariable("Expect parameter name");
 			defineVariable(constant);
 		} while (match(TOKEN_COMMA));
 	}
@@ -365,7 +578,7 @@ static void function(FunctionType type) {
 }
 
 static void funDeclaration() {
-	uint8_t global = parseVariable("Expect function name.");
+	uint16_t global = parseVariable("Expect function name.");
 	markInitialized();
 	function(TYPE_FUNCTION);
 	defineVariable(global);
@@ -380,7 +593,7 @@ static void and_(bool canAssign) {
 }
 
 static void varDeclaration() {
-	uint8_t global = parseVariable("Expect variable name.");
+	uint16_t global = parseVariable("Expect variable name.");
 
 	if (match(TOKEN_EQUAL)) {
 		expression();
@@ -481,6 +694,14 @@ static void returnStatement() {
 	// Evaluate the expression to the right of the return
 	expression();
 	consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+	// `return f(x);` hands the frame over to f instead of waiting for it. The OP_RETURN stays, it's
+	// reached when a jump skips the call, as in `return a and f(x);`.
+	Chunk *chunk = currentChunk();
+	int lastCall = current->lastCall;
+	if (lastCall >= 0 && lastCall + instructionLength(OP_CALL) == chunk->count &&
+		chunk->code[lastCall] == OP_CALL) {
+		chunk->code[lastCall] = OP_TAIL_CALL;
+	}
 	emitReturn();
 }
 
@@ -555,10 +776,102 @@ static void statement() {
 	}
 }
 
+// Evaluates a binary operator on two constants the way the VM would. Returns false when the VM
+// would raise a runtime error instead, the operator is then left for the VM so the error still
+// happens, at run time and with its line.
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value *result) {
+	if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+		bool equal = valuesEqual(a, b);
+		*result = BOOL_VAL(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+		return true;
+	}
+	if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+		ObjString *left = AS_STRING(a);
+		ObjString *right = AS_STRING(b);
+		int length = left->length + right->length;
+		char *chars = ALLOCATE(char, length + 1);
+		memcpy(chars, left->chars, left->length);
+		memcpy(chars + left->length, right->chars, right->length);
+		chars[length] = '\0';
+		*result = OBJ_VAL(takeString(chars, length));
+		return true;
+	}
+	if (!IS_NUMBER(a) || !IS_NUMBER(b))
+		return false;
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+	switch (operatorType) {
+	case TOKEN_PLUS:
+		*result = NUMBER_VAL(x + y);
+		return true;
+	case TOKEN_MINUS:
+		*result = NUMBER_VAL(x - y);
+		return true;
+	case TOKEN_STAR:
+		*result = NUMBER_VAL(x * y);
+		return true;
+	case TOKEN_SLASH:
+		*result = NUMBER_VAL(x / y);
+		return true;
+	case TOKEN_GREATER:
+		*result = BOOL_VAL(x > y);
+		return true;
+	case TOKEN_LESS:
+		*result = BOOL_VAL(x < y);
+		return true;
+	// Compiled as the negated opposite comparison, which is what makes NaN >= NaN true.
+	case TOKEN_GREATER_EQUAL:
+		*result = BOOL_VAL(!(x < y));
+		return true;
+	case TOKEN_LESS_EQUAL:
+		*result = BOOL_VAL(!(x > y));
+		return true;
+	default:
+		return false;
+	}
+}
+
+// `x / 2^k` becomes `x * 2^-k`. The reciprocal of a power of two is exact, so both give the same
+// correctly rounded result, and both raise the same error for non-numbers. Other rewrites such as
+// `x * 2` to `x + x` would turn a type error into string concatenation, so they are left alone.
+static bool reciprocalOfPowerOfTwo(Value divisor, Value *reciprocal) {
+	if (!IS_NUMBER(divisor))
+		return false;
+	int exponent;
+	double mantissa = frexp(AS_NUMBER(divisor), &exponent);
+	// Exact powers of two have a mantissa of 0.5, the exponent range keeps 1/d a normal number.
+	if (mantissa != 0.5 || exponent < -1020 || exponent > 1020)
+		return false;
+	*reciprocal = NUMBER_VAL(1.0 / AS_NUMBER(divisor));
+	return true;
+}
+
 static void binary(bool canAssign) {
 	TokenType operatorType = parser.previous.type;
 	ParseRule *rule = getRule(operatorType);
+	int rightStart = currentChunk()->count;
 	parsePrecedence((Precedence)(rule->precedence + 1));
+
+	int start;
+	Value left;
+	Value right;
+	if (constantOperand(currentChunk()->count, &rightStart, &right)) {
+		Value result;
+		if (constantOperand(rightStart, &start, &left) &&
+			foldBinary(operatorType, left, right, &result)) {
+			// The folded value has to stay reachable while it's added to the constants.
+			push(result);
+			replaceWithConstant(start, result);
+			pop();
+			return;
+		}
+		if (operatorType == TOKEN_SLASH && reciprocalOfPowerOfTwo(right, &result)) {
+			replaceWithConstant(rightStart, result);
+			emitByte(OP_MULTIPLY);
+			return;
+		}
+	}
+
 	switch (operatorType) {
 	case TOKEN_BANG_EQUAL:
 		emitBytes(OP_EQUAL, OP_NOT);
@@ -627,10 +940,18 @@ static void call(bool canAssign) {
 	// offset backwards at runtime where the function pointer will be stored. We have the arity of
 	// the function from its declaration we can use.
 	uint8_t count = argumentsList(canAssign);
+	// Each call site gets its own inline cache, the VM finds it through the second operand.
+	int cache = addCallCache(currentChunk());
+	if (cache > UINT16_MAX) {
+		error("Too many calls in one function.");
+	}
+	current->lastCall = currentChunk()->count;
 	emitBytes(OP_CALL, count);
+	emitBytes((cache >> 8) & 0xff, cache & 0xff);
 }
 
 static void literal(bool canAssign) {
+	int start = currentChunk()->count;
 	switch (parser.previous.type) {
 	case TOKEN_FALSE:
 		emitByte(OP_FALSE);
@@ -644,6 +965,7 @@ static void literal(bool canAssign) {
 	default:
 		return; // Unreachable.
 	}
+	recordConstant(start, false);
 }
 static void grouping(bool canAssign) {
 	expression();
@@ -674,19 +996,24 @@ static void string(bool canAssign) {
 static void namedVariable(Token name, bool canAssign) {
 	uint8_t getOp, setOp;
 	int arg = resolveLocal(current, &name);
-	if (arg != -1) {
+	bool isGlobal = arg == -1;
+	if (!isGlobal) {
 		getOp = OP_GET_LOCAL;
 		setOp = OP_SET_LOCAL;
 	} else {
-		arg = identifierConstant(&name);
+		arg = identifierGlobal(&name);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
 	}
+	uint8_t op = getOp;
 	if (canAssign && match(TOKEN_EQUAL)) {
 		expression();
-		emitBytes(setOp, arg);
+		op = setOp;
+	}
+	if (isGlobal) {
+		emitGlobal(op, arg);
 	} else {
-		emitBytes(getOp, arg);
+		emitBytes(op, arg);
 	}
 }
 static void variable(bool canAssign) { namedVariable(parser.previous, canAssign); }
@@ -694,10 +1021,29 @@ static void variable(bool canAssign) { namedVariable(parser.previous, canAssign)
 static void unary(bool canAssign) {
 	TokenType operatorType = parser.previous.type;
 	parsePrecedence(PREC_UNARY);
+
+	int start;
+	Value operand;
+	if (constantOperand(currentChunk()->count, &start, &operand)) {
+		// Negating a non-number is a runtime error, so that one stays in the code.
+		if (operatorType == TOKEN_BANG) {
+			bool falsey = IS_NIL(operand) || (IS_BOOL(operand) && !AS_BOOL(operand));
+			replaceWithConstant(start, BOOL_VAL(falsey));
+			return;
+		}
+		if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+			replaceWithConstant(start, NUMBER_VAL(-AS_NUMBER(operand)));
+			return;
+		}
+	}
+
 	switch (operatorType) {
 	case TOKEN_MINUS:
 		emitByte(OP_NEGATE);
 		break;
+	case TOKEN_BANG:
+		emitByte(OP_NOT);
+		break;
 	default:
 		return;
 	}
@@ -771,7 +1117,9 @@ const char *precedenceNames[] = {"PREC_NONE",	  "PREC_ASSIGNMENT", "PREC_OR",		"
 //		 Depth 3: precendence = FACTOR + 1 == UNARY
 //			 5. Consume 3 (prefixRule -> number)
 static void parsePrecedence(Precedence precedence) {
+#ifdef DEBUG_PRINT_CODE
 	printf("precedence %s\n", precedenceNames[precedence]);
+#endif
 	advance();
 	// We get the rule for the token we're on,
 	// i.e. what its ParseFn for infix, prefix and infix precedence
@@ -802,8 +1150,27 @@ static void parsePrecedence(Precedence precedence) {
 
 static ParseRule *getRule(TokenType type) { return &rules[type]; }
 
+static void finalizeFunction(ObjFunction *function) {
+	// Already done, a shared pool lists each function once but is reached from every function.
+	if (function->chunk.arena == NULL)
+		return;
+	finalizeChunk(&function->chunk);
+	ObjFunction *owner = (ObjFunction *)function->chunk.constantsOwner;
+	if (owner != NULL) {
+		// The owner is finalized first and its pool holds every function of the script.
+		function->chunk.constants = owner->chunk.constants;
+		return;
+	}
+	for (int i = 0; i < function->chunk.constants.count; i++) {
+		Value constant = function->chunk.constants.values[i];
+		if (IS_FUNCTION(constant))
+			finalizeFunction(AS_FUNCTION(constant));
+	}
+}
+
 ObjFunction *compile(const char *source) {
 	initScanner(source);
+	initArena(&compileArena);
 	Compiler compiler;
 	initCompiler(&compiler, TYPE_SCRIPT);
 	parser.hadError = false;
@@ -813,5 +1180,21 @@ ObjFunction *compile(const char *source) {
 		declaration();
 	}
 	ObjFunction *function = endCompiler();
+	// Every function compiled in this session is the script or nested in its constants. Copy them
+	// all out of the arena, even after an error, since the collector may still free them later.
+	push(OBJ_VAL(function));
+	finalizeFunction(function);
+	pop();
+	freeArena(&compileArena);
 	return parser.hadError ? NULL : function;
 };
+
+// Functions still being compiled aren't reachable from the VM yet, so the collector asks the
+// compiler for them.
+void markCompilerRoots() {
+	Compiler *compiler = current;
+	while (compiler != NULL) {
+		markObject((Obj *)compiler->function);
+		compiler = compiler->enclosing;
+	}
+}
@@ -4,5 +4,6 @@
 #include "object.h"
 
 ObjFunction *compile(const char *source);
+void markCompilerRoots();
 
 #endif
@@ -1,12 +1,55 @@
 #include "debug.h"
 #include "chunk.h"
+#include "object.h"
 #include "value.h"
+#include "vm.h"
 #include <stdio.h>
 
 static int debugCharsWritten;
 
 int getDebugCharsWritten() { return debugCharsWritten; }
 
+static const char *opcodeNames[UINT8_COUNT] = {
+	[OP_CONSTANT] = "OP_CONSTANT",
+	[OP_NIL] = "OP_NIL",
+	[OP_TRUE] = "OP_TRUE",
+	[OP_FALSE] = "OP_FALSE",
+	[OP_CALL] = "OP_CALL",
+	[OP_POP] = "OP_POP",
+	[OP_GET_LOCAL] = "OP_GET_LOCAL",
+	[OP_SET_LOCAL] = "OP_SET_LOCAL",
+	[OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+	[OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+	[OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+	[OP_EQUAL] = "OP_EQUAL",
+	[OP_GREATER] = "OP_GREATER",
+	[OP_LESS] = "OP_LESS",
+	[OP_ADD] = "OP_ADD",
+	[OP_SUBTRACT] = "OP_SUBTRACT",
+	[OP_MULTIPLY] = "OP_MULTIPLY",
+	[OP_DIVIDE] = "OP_DIVIDE",
+	[OP_NOT] = "OP_NOT",
+	[OP_NEGATE] = "OP_NEGATE",
+	[OP_PRINT] = "OP_PRINT",
+	[OP_JUMP] = "OP_JUMP",
+	[OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+	[OP_LOOP] = "OP_LOOP",
+	[OP_RETURN] = "OP_RETURN",
+	[OP_TAIL_CALL] = "OP_TAIL_CALL",
+	[OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+	[OP_LESS_JUMP_IF_FALSE] = "OP_LESS_JUMP_IF_FALSE",
+	[OP_ADD_CONSTANT] = "OP_ADD_CONSTANT",
+	[OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+	[OP_ADD_NUM] = "OP_ADD_NUM",
+	[OP_ADD_STR] = "OP_ADD_STR",
+	[OP_EQUAL_NUM] = "OP_EQUAL_NUM",
+};
+
+const char *opcodeName(uint8_t instruction) {
+	const char *name = opcodeNames[instruction];
+	return name != NULL ? name : "OP_UNKNOWN";
+}
+
 void disassembleChunk(Chunk *chunk, const char *name) {
 	printf("== %s ==\n", name);
 	printf("%-5s%4s %-16s %4s %s\n", "BYTE", "LN", "OPCODE", "ARG", "VAL");
@@ -31,6 +74,20 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
 	return offset + 2; // 2 to account for operand
 }
 
+static int twoByteInstruction(const char *name, Chunk *chunk, int offset) {
+	uint8_t first = chunk->code[offset + 1];
+	uint8_t second = chunk->code[offset + 2];
+	debugCharsWritten += printf("%-16s %4d %d", name, first, second);
+	return offset + 3;
+}
+
+static int callInstruction(const char *name, Chunk *chunk, int offset) {
+	uint8_t argCount = chunk->code[offset + 1];
+	uint16_t cache = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+	debugCharsWritten += printf("%-16s %4d cache %d", name, argCount, cache);
+	return offset + 4;
+}
+
 static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset) {
 	uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
 	jump |= chunk->code[offset + 2];
@@ -48,14 +105,26 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
 	return offset + 2;
 }
 
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+	// The operand is a slot in the VM's globals array, its name comes from vm.globalNames.
+	uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+	debugCharsWritten += printf("%-16s %4d '", name, slot);
+	if (slot < vm.globalNames.count) {
+		debugCharsWritten += printValue(vm.globalNames.values[slot]);
+	}
+	debugCharsWritten += printf("'");
+	return offset + 3;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
 	debugCharsWritten = 0;
 	debugCharsWritten += printf("%04d ", offset);
-	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+	int line = getLine(chunk, offset);
+	if (offset > 0 && line == getLine(chunk, offset - 1)) {
 		// don't print the line number again
 		debugCharsWritten += printf("   | ");
 	} else {
-		debugCharsWritten += printf("%4d ", chunk->lines[offset]);
+		debugCharsWritten += printf("%4d ", line);
 	}
 	uint8_t instruction = chunk->code[offset];
 	switch (instruction) {
@@ -87,11 +156,11 @@ int disassembleInstruction(Chunk *chunk, int offset) {
 	case OP_SET_LOCAL:
 		return byteInstruction("OP_SET_LOCAL", chunk, offset);
 	case OP_GET_GLOBAL:
-		return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+		return globalInstruction("OP_GET_GLOBAL", chunk, offset);
 	case OP_DEFINE_GLOBAL:
-		return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+		return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
 	case OP_SET_GLOBAL:
-		return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+		return globalInstruction("OP_SET_GLOBAL", chunk, offset);
 	case OP_EQUAL:
 		return simpleInstruction("OP_EQUAL", offset);
 	case OP_GREATER:
@@ -111,9 +180,127 @@ int disassembleInstruction(Chunk *chunk, int offset) {
 	case OP_NOT:
 		return simpleInstruction("OP_NOT", offset);
 	case OP_CALL:
-		return byteInstruction("OP_CALL", chunk, offset);
+		return callInstruction("OP_CALL", chunk, offset);
+	case OP_TAIL_CALL:
+		return callInstruction("OP_TAIL_CALL", chunk, offset);
+	case OP_ADD_LOCALS:
+		return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+	case OP_LESS_JUMP_IF_FALSE:
+		return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+	case OP_ADD_CONSTANT:
+		return constantInstruction("OP_ADD_CONSTANT", chunk, offset);
+	case OP_SET_LOCAL_POP:
+		return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+	case OP_ADD_NUM:
+		return simpleInstruction("OP_ADD_NUM", offset);
+	case OP_ADD_STR:
+		return simpleInstruction("OP_ADD_STR", offset);
+	case OP_EQUAL_NUM:
+		return simpleInstruction("OP_EQUAL_NUM", offset);
 	default:
 		debugCharsWritten += printf("Unknown OpCode %d", instruction);
 		return offset + 1;
 	}
 }
+
+// Register chunks are printed one fixed size instruction per line with their operands decoded,
+// constants are looked up in the stack chunk's pool which both instruction sets share.
+static const char *registerOpNames[] = {
+	[ROP_MOVE] = "ROP_MOVE",
+	[ROP_LOADK] = "ROP_LOADK",
+	[ROP_LOADNIL] = "ROP_LOADNIL",
+	[ROP_LOADTRUE] = "ROP_LOADTRUE",
+	[ROP_LOADFALSE] = "ROP_LOADFALSE",
+	[ROP_GET_GLOBAL] = "ROP_GET_GLOBAL",
+	[ROP_DEFINE_GLOBAL] = "ROP_DEFINE_GLOBAL",
+	[ROP_SET_GLOBAL] = "ROP_SET_GLOBAL",
+	[ROP_EQUAL] = "ROP_EQUAL",
+	[ROP_GREATER] = "ROP_GREATER",
+	[ROP_LESS] = "ROP_LESS",
+	[ROP_ADD] = "ROP_ADD",
+	[ROP_ADD_CONSTANT] = "ROP_ADD_CONSTANT",
+	[ROP_SUBTRACT] = "ROP_SUBTRACT",
+	[ROP_MULTIPLY] = "ROP_MULTIPLY",
+	[ROP_DIVIDE] = "ROP_DIVIDE",
+	[ROP_NOT] = "ROP_NOT",
+	[ROP_NEGATE] = "ROP_NEGATE",
+	[ROP_PRINT] = "ROP_PRINT",
+	[ROP_JUMP] = "ROP_JUMP",
+	[ROP_JUMP_IF_FALSE] = "ROP_JUMP_IF_FALSE",
+	[ROP_LESS_JUMP] = "ROP_LESS_JUMP",
+	[ROP_CALL] = "ROP_CALL",
+	[ROP_TAIL_CALL] = "ROP_TAIL_CALL",
+	[ROP_RETURN] = "ROP_RETURN",
+};
+
+void disassembleRegisterChunk(Chunk *chunk, const char *name) {
+	printf("== %s (registers) ==\n", name);
+	printf("%-5s%4s %-18s %s\n", "BYTE", "LN", "OPCODE", "OPERANDS");
+	for (int offset = 0; offset < chunk->count;) {
+		offset = disassembleRegisterInstruction(chunk, offset);
+		printf("\n");
+	}
+}
+
+int disassembleRegisterInstruction(Chunk *chunk, int offset) {
+	debugCharsWritten = 0;
+	debugCharsWritten += printf("%04d ", offset);
+	int line = getLine(chunk, offset);
+	if (offset > 0 && line == getLine(chunk, offset - 1)) {
+		debugCharsWritten += printf("   | ");
+	} else {
+		debugCharsWritten += printf("%4d ", line);
+	}
+	uint8_t instruction = chunk->code[offset];
+	uint8_t a = chunk->code[offset + 1];
+	uint8_t b = chunk->code[offset + 2];
+	uint8_t c = chunk->code[offset + 3];
+	int next = offset + REG_INSTRUCTION_SIZE;
+	if (instruction > ROP_RETURN) {
+		debugCharsWritten += printf("Unknown RegOpCode %d", instruction);
+		return next;
+	}
+	debugCharsWritten += printf("%-18s ", registerOpNames[instruction]);
+	switch (instruction) {
+	case ROP_LOADNIL:
+	case ROP_LOADTRUE:
+	case ROP_LOADFALSE:
+	case ROP_PRINT:
+	case ROP_RETURN:
+		debugCharsWritten += printf("r%d", a);
+		break;
+	case ROP_MOVE:
+	case ROP_NOT:
+	case ROP_NEGATE:
+		debugCharsWritten += printf("r%d r%d", a, b);
+		break;
+	case ROP_LOADK:
+		debugCharsWritten += printf("r%d k%d", a, b);
+		break;
+	case ROP_GET_GLOBAL:
+	case ROP_DEFINE_GLOBAL:
+	case ROP_SET_GLOBAL:
+		debugCharsWritten += printf("r%d g%d", a, (b << 8) | c);
+		break;
+	case ROP_ADD_CONSTANT:
+		debugCharsWritten += printf("r%d r%d k%d", a, b, c);
+		break;
+	case ROP_JUMP:
+		debugCharsWritten += printf("-> %d", next + (int16_t)((b << 8) | c));
+		break;
+	case ROP_JUMP_IF_FALSE:
+		debugCharsWritten += printf("r%d -> %d", a, next + (int16_t)((b << 8) | c));
+		break;
+	case ROP_LESS_JUMP:
+		debugCharsWritten += printf("r%d r%d", a, b);
+		break;
+	case ROP_CALL:
+	case ROP_TAIL_CALL:
+		debugCharsWritten += printf("r%d args=%d", a, b);
+		break;
+	default:
+		debugCharsWritten += printf("r%d r%d r%d", a, b, c);
+		break;
+	}
+	return next;
+}
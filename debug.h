@@ -6,5 +6,9 @@
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
 int getDebugCharsWritten();
+// "OP_ADD" for OP_ADD, "OP_UNKNOWN" for bytes that aren't an opcode.
+const char *opcodeName(uint8_t instruction);
+void disassembleRegisterChunk(Chunk *chunk, const char *name);
+int disassembleRegisterInstruction(Chunk *chunk, int offset);
 
 #endif
@@ -0,0 +1,1271 @@
+#include "jit.h"
+
+#ifdef JIT
+#include "chunk.h"
+#include "memory.h"
+#include "sampler.h"
+#include "vm.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Register use inside generated code. All four are callee-saved in the System V ABI, so they
+// survive the calls into the runtime helpers.
+//   rbx  the current CallFrame
+//   r12  frame->slots
+//   r13  the value stack top, only written back to vm.stackTop before a helper call or an exit
+//   r14  &vm
+//   r15  QNAN, when values are NaN-boxed
+// rax, rcx, rdx, rdi, rsi, xmm0 and xmm1 are scratch.
+enum {
+	RAX,
+	RCX,
+	RDX,
+	RBX,
+	RSP,
+	RBP,
+	RSI,
+	RDI,
+	R8,
+	R9,
+	R10,
+	R11,
+	R12,
+	R13,
+	R14,
+	R15,
+};
+#define FRAME RBX
+#define SLOTS R12
+#define TOP R13
+#define VM_REG R14
+
+enum { XMM0, XMM1 };
+
+// Condition codes, the low nibble of jcc and setcc.
+enum {
+	CC_B = 0x2,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_BE = 0x6,
+	CC_A = 0x7,
+	CC_NP = 0xb,
+	CC_GE = 0xd,
+};
+
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+
+// Most templates go through memory: operands are read from the value stack and the result is
+// written back to it. Locals, constants and the results of arithmetic on them are instead kept
+// "virtual" at compile time, on top of the real stack, as long as the instructions consuming them
+// can use them where they are: a slot, an immediate or an xmm register. Anything else first
+// materializes them onto the real stack, as do jump targets, so every branch sees the same state.
+#define VIRTUAL_MAX 8
+// xmm0 and xmm1 are scratch, numbers live in xmm2-xmm15. VIRTUAL_MAX of them are never short.
+#define XMM_FIRST 2
+#define XMM_COUNT 16
+
+typedef enum {
+	VIRTUAL_CONSTANT,
+	VIRTUAL_LOCAL,
+	VIRTUAL_NUMBER,
+} VirtualKind;
+
+typedef struct {
+	VirtualKind kind;
+	// The local's slot or the xmm register holding the number.
+	int index;
+	Value value;
+	// Constant table entry to copy objects from, see OP_CONSTANT.
+	Value *source;
+} Virtual;
+
+// A type guard that failed with virtual values on the stack. The interpreter redoes the
+// instruction, so they are materialized before leaving.
+typedef struct {
+	int at;
+	int offset;
+	int count;
+	Virtual stack[VIRTUAL_MAX];
+} Deopt;
+
+// A branch whose rel32 has to be filled in once its destination is known.
+typedef struct {
+	int at;		// Offset of the rel32 in the code.
+	int target; // Bytecode offset it goes to.
+} Patch;
+
+typedef struct {
+	Patch *items;
+	int count;
+	int capacity;
+} PatchList;
+
+typedef struct {
+	ObjFunction *function;
+	Chunk *chunk;
+	uint8_t *code;
+	int count;
+	int capacity;
+	int *entries;
+	// Branches to other instructions, to the exit stub of an instruction, and to the error exit.
+	PatchList jumps;
+	PatchList exits;
+	PatchList errors;
+	// Bytecode offsets that are jumped to, the virtual stack is empty there.
+	bool *targets;
+	// Stack depth before each instruction, see stackDepths().
+	int *depths;
+	Virtual stack[VIRTUAL_MAX];
+	int virtualCount;
+	bool xmmUsed[XMM_COUNT];
+	Deopt *deopts;
+	int deoptCount;
+	int deoptCapacity;
+} Jit;
+
+static void addPatch(PatchList *list, int at, int target) {
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity < 16 ? 16 : list->capacity * 2;
+		list->items = realloc(list->items, sizeof(Patch) * list->capacity);
+		if (list->items == NULL)
+			exit(1);
+	}
+	list->items[list->count].at = at;
+	list->items[list->count].target = target;
+	list->count++;
+}
+
+static void emitByte(Jit *jit, uint8_t byte) {
+	if (jit->count == jit->capacity) {
+		jit->capacity = jit->capacity < 256 ? 256 : jit->capacity * 2;
+		jit->code = realloc(jit->code, jit->capacity);
+		if (jit->code == NULL)
+			exit(1);
+	}
+	jit->code[jit->count++] = byte;
+}
+
+static void emit32(Jit *jit, uint32_t value) {
+	for (int i = 0; i < 4; i++)
+		emitByte(jit, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Jit *jit, uint64_t value) {
+	for (int i = 0; i < 8; i++)
+		emitByte(jit, (uint8_t)(value >> (8 * i)));
+}
+
+// Mandatory prefix (0x66/0xf2 for SSE, 0 for none), REX when needed, then the one or two byte
+// (0x0fxx) opcode.
+static void emitOpcode(Jit *jit, uint8_t prefix, bool wide, int opcode, int reg, int rm) {
+	if (prefix != 0)
+		emitByte(jit, prefix);
+	uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+	if (rex != 0x40)
+		emitByte(jit, rex);
+	if (opcode > 0xff)
+		emitByte(jit, (uint8_t)(opcode >> 8));
+	emitByte(jit, (uint8_t)opcode);
+}
+
+// opcode reg, [base + disp]. Always the disp32 form, which needs no special cases for rbp and r13.
+static void emitMem(Jit *jit, uint8_t prefix, bool wide, int opcode, int reg, int base,
+					int32_t disp) {
+	emitOpcode(jit, prefix, wide, opcode, reg, base);
+	emitByte(jit, (uint8_t)(0x80 | ((reg & 7) << 3) | (base & 7)));
+	// rsp and r12 as a base need a SIB byte.
+	if ((base & 7) == RSP)
+		emitByte(jit, 0x24);
+	emit32(jit, (uint32_t)disp);
+}
+
+// opcode reg, rm with both operands registers.
+static void emitRegs(Jit *jit, uint8_t prefix, bool wide, int opcode, int reg, int rm) {
+	emitOpcode(jit, prefix, wide, opcode, reg, rm);
+	emitByte(jit, (uint8_t)(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+static void movImm64(Jit *jit, int reg, uint64_t value) {
+	emitOpcode(jit, 0, true, 0xb8 + (reg & 7), 0, reg);
+	emit64(jit, value);
+}
+
+static void movImm32(Jit *jit, int reg, uint32_t value) {
+	emitOpcode(jit, 0, false, 0xb8 + (reg & 7), 0, reg);
+	emit32(jit, value);
+}
+
+static void load64(Jit *jit, int reg, int base, int32_t disp) {
+	emitMem(jit, 0, true, 0x8b, reg, base, disp);
+}
+
+static void store64(Jit *jit, int base, int32_t disp, int reg) {
+	emitMem(jit, 0, true, 0x89, reg, base, disp);
+}
+
+static void addImm(Jit *jit, int reg, int32_t value) {
+	emitRegs(jit, 0, true, 0x81, 0, reg);
+	emit32(jit, (uint32_t)value);
+}
+
+static void lea(Jit *jit, int reg, int base, int32_t disp) {
+	emitMem(jit, 0, true, 0x8d, reg, base, disp);
+}
+
+static void pushReg(Jit *jit, int reg) { emitOpcode(jit, 0, false, 0x50 + (reg & 7), 0, reg); }
+
+static void popReg(Jit *jit, int reg) { emitOpcode(jit, 0, false, 0x58 + (reg & 7), 0, reg); }
+
+static void callAddress(Jit *jit, void *function) {
+	movImm64(jit, RAX, (uint64_t)(uintptr_t)function);
+	emitRegs(jit, 0, false, 0xff, 2, RAX);
+}
+
+// Conditional or unconditional rel32 branch with a placeholder target, returns where the rel32 is.
+static int jump(Jit *jit, int cc) {
+	if (cc < 0) {
+		emitByte(jit, 0xe9);
+	} else {
+		emitByte(jit, 0x0f);
+		emitByte(jit, (uint8_t)(0x80 | cc));
+	}
+	emit32(jit, 0);
+	return jit->count - 4;
+}
+
+static void patchTo(Jit *jit, int at, int destination) {
+	int32_t rel = destination - (at + 4);
+	memcpy(jit->code + at, &rel, sizeof(rel));
+}
+
+static void patchHere(Jit *jit, int at) { patchTo(jit, at, jit->count); }
+
+static void setcc(Jit *jit, int cc, int reg) { emitRegs(jit, 0, false, 0x0f90 | cc, 0, reg); }
+
+// Value layout --------------------------------------------------------------------------------
+
+// Values are only ever written and read as whole 64-bit words. A narrower store followed by a
+// wider load of the same bytes can't be forwarded and stalls until the store has retired, which
+// costs more than the template it sits in.
+
+// Copies a whole Value between two memory operands.
+static void copyValue(Jit *jit, int toBase, int32_t toDisp, int fromBase, int32_t fromDisp) {
+	load64(jit, RAX, fromBase, fromDisp);
+#ifndef NAN_BOXING
+	load64(jit, RCX, fromBase, fromDisp + 8);
+	store64(jit, toBase, toDisp + 8, RCX);
+#endif
+	store64(jit, toBase, toDisp, RAX);
+}
+
+#ifndef NAN_BOXING
+// Stores the type tag as a whole word, padding included.
+static void storeType(Jit *jit, int base, int32_t disp, ValueType type) {
+	// mov qword [], imm
+	emitMem(jit, 0, true, 0xc7, 0, base, disp + (int32_t)offsetof(Value, type));
+	emit32(jit, type);
+}
+#endif
+
+// Stores a Value known at compile time.
+static void storeValue(Jit *jit, int base, int32_t disp, Value value) {
+	uint64_t words[sizeof(Value) / 8];
+	memcpy(words, &value, sizeof(Value));
+	for (size_t i = 0; i < sizeof(Value) / 8; i++) {
+		movImm64(jit, RAX, words[i]);
+		store64(jit, base, disp + (int32_t)(8 * i), RAX);
+	}
+}
+
+// Loads the number at [base + disp] into xmm. Returns the branch taken when it isn't a number.
+static int loadNumber(Jit *jit, int xmm, int base, int32_t disp) {
+#ifdef NAN_BOXING
+	load64(jit, RAX, base, disp);
+	emitRegs(jit, 0, true, 0x89, RAX, RCX); // mov rcx, rax
+	emitRegs(jit, 0, true, 0x21, R15, RCX); // and rcx, r15
+	emitRegs(jit, 0, true, 0x39, R15, RCX); // cmp rcx, r15
+	int fail = jump(jit, CC_E);
+	emitRegs(jit, 0x66, true, 0x0f6e, xmm, RAX); // movq xmm, rax
+	return fail;
+#else
+	emitMem(jit, 0, false, 0x81, 7, base, disp + (int32_t)offsetof(Value, type));
+	emit32(jit, VAL_NUMBER);
+	int fail = jump(jit, CC_NE);
+	emitMem(jit, 0xf2, false, 0x0f10, xmm, base, disp + (int32_t)offsetof(Value, as)); // movsd
+	return fail;
+#endif
+}
+
+static void storeNumber(Jit *jit, int base, int32_t disp, int xmm) {
+#ifdef NAN_BOXING
+	emitMem(jit, 0xf2, false, 0x0f11, xmm, base, disp); // movsd
+#else
+	storeType(jit, base, disp, VAL_NUMBER);
+	emitMem(jit, 0xf2, false, 0x0f11, xmm, base, disp + (int32_t)offsetof(Value, as));
+#endif
+}
+
+// Stores the boolean in al (0 or 1).
+static void storeBool(Jit *jit, int base, int32_t disp) {
+	emitRegs(jit, 0, false, 0x0fb6, RAX, RAX); // movzx eax, al
+#ifdef NAN_BOXING
+	movImm64(jit, RCX, FALSE_VAL);
+	emitRegs(jit, 0, true, 0x01, RCX, RAX); // add rax, rcx: TRUE_VAL is FALSE_VAL + 1
+	store64(jit, base, disp, RAX);
+#else
+	storeType(jit, base, disp, VAL_BOOL);
+	store64(jit, base, disp + (int32_t)offsetof(Value, as), RAX);
+#endif
+}
+
+// Sets al to whether the value at [base + disp] is falsey: nil or false.
+static void testFalsey(Jit *jit, int base, int32_t disp) {
+#ifdef NAN_BOXING
+	load64(jit, RDX, base, disp);
+	movImm64(jit, RCX, NIL_VAL);
+	emitRegs(jit, 0, true, 0x39, RCX, RDX); // cmp rdx, rcx
+	setcc(jit, CC_E, RAX);
+	movImm64(jit, RCX, FALSE_VAL);
+	emitRegs(jit, 0, true, 0x39, RCX, RDX);
+	setcc(jit, CC_E, RCX);
+	emitRegs(jit, 0, false, 0x08, RCX, RAX); // or al, cl
+#else
+	int32_t type = disp + (int32_t)offsetof(Value, type);
+	emitMem(jit, 0, false, 0x81, 7, base, type);
+	emit32(jit, VAL_NIL);
+	setcc(jit, CC_E, RDX);
+	emitMem(jit, 0, false, 0x81, 7, base, type);
+	emit32(jit, VAL_BOOL);
+	setcc(jit, CC_E, RAX);
+	emitMem(jit, 0, false, 0x80, 7, base, disp + (int32_t)offsetof(Value, as)); // cmp byte [], 0
+	emitByte(jit, 0);
+	setcc(jit, CC_E, RCX);
+	emitRegs(jit, 0, false, 0x20, RCX, RAX); // and al, cl
+	emitRegs(jit, 0, false, 0x08, RDX, RAX); // or al, dl
+#endif
+}
+
+// Returns the branch taken when the value at [base + disp] is an object.
+static int jumpIfObject(Jit *jit, int base, int32_t disp) {
+#ifdef NAN_BOXING
+	load64(jit, RAX, base, disp);
+	movImm64(jit, RCX, QNAN | SIGN_BIT);
+	emitRegs(jit, 0, true, 0x21, RCX, RAX); // and rax, rcx
+	emitRegs(jit, 0, true, 0x39, RCX, RAX); // cmp rax, rcx
+	return jump(jit, CC_E);
+#else
+	emitMem(jit, 0, false, 0x81, 7, base, disp + (int32_t)offsetof(Value, type));
+	emit32(jit, VAL_OBJ);
+	return jump(jit, CC_E);
+#endif
+}
+
+// Returns the branch taken when the value at [base + disp] is UNDEFINED_VAL.
+static int jumpIfUndefined(Jit *jit, int base, int32_t disp) {
+#ifdef NAN_BOXING
+	load64(jit, RAX, base, disp);
+	movImm64(jit, RCX, UNDEFINED_VAL);
+	emitRegs(jit, 0, true, 0x39, RCX, RAX);
+	return jump(jit, CC_E);
+#else
+	emitMem(jit, 0, false, 0x81, 7, base, disp + (int32_t)offsetof(Value, type));
+	emit32(jit, VAL_UNDEFINED);
+	return jump(jit, CC_E);
+#endif
+}
+
+// Frame state ---------------------------------------------------------------------------------
+
+// Points rbx at the top frame and reloads slots and the stack top. Calls may have pushed a frame,
+// grown vm.frames or moved the value stack.
+static void loadFrame(Jit *jit) {
+	load64(jit, RAX, VM_REG, (int32_t)offsetof(VM, frames));
+	emitMem(jit, 0, true, 0x63, RCX, VM_REG, (int32_t)offsetof(VM, frameCount)); // movsxd
+	emitRegs(jit, 0, true, 0x69, RCX, RCX); // imul rcx, rcx, imm
+	emit32(jit, sizeof(CallFrame));
+	emitRegs(jit, 0, true, 0x01, RCX, RAX); // add rax, rcx
+	lea(jit, FRAME, RAX, -(int32_t)sizeof(CallFrame));
+	load64(jit, SLOTS, FRAME, (int32_t)offsetof(CallFrame, slots));
+	load64(jit, TOP, VM_REG, (int32_t)offsetof(VM, stackTop));
+}
+
+// Writes the stack top and ip back where the runtime expects them. `ip` is the bytecode the frame
+// is at, for stack traces and for the interpreter to continue from.
+static void saveFrame(Jit *jit, uint8_t *ip) {
+	store64(jit, VM_REG, (int32_t)offsetof(VM, stackTop), TOP);
+	movImm64(jit, RAX, (uint64_t)(uintptr_t)ip);
+	store64(jit, FRAME, (int32_t)offsetof(CallFrame, ip), RAX);
+}
+
+static void reloadTop(Jit *jit) { load64(jit, TOP, VM_REG, (int32_t)offsetof(VM, stackTop)); }
+
+// Leaves to the interpreter at the instruction at `offset` when the branch is taken.
+static void exitOn(Jit *jit, int branch, int offset) {
+	if (jit->virtualCount == 0) {
+		addPatch(&jit->exits, branch, offset);
+		return;
+	}
+	if (jit->deoptCount == jit->deoptCapacity) {
+		jit->deoptCapacity = jit->deoptCapacity < 8 ? 8 : jit->deoptCapacity * 2;
+		jit->deopts = realloc(jit->deopts, sizeof(Deopt) * jit->deoptCapacity);
+		if (jit->deopts == NULL)
+			exit(1);
+	}
+	Deopt *deopt = &jit->deopts[jit->deoptCount++];
+	deopt->at = branch;
+	deopt->offset = offset;
+	deopt->count = jit->virtualCount;
+	memcpy(deopt->stack, jit->stack, sizeof(Virtual) * jit->virtualCount);
+}
+
+// Templates run with nothing of their own on the machine stack, so they can return to whoever
+// called the function's code from any instruction.
+static void leave(Jit *jit, JitResult result) {
+	movImm32(jit, RAX, result);
+	emitByte(jit, 0xc3); // ret
+}
+
+// Same poll as SAFEPOINT() in vm.c: take a pending profiler sample with ip written back.
+static void safepoint(Jit *jit, uint8_t *ip) {
+	movImm64(jit, RAX, (uint64_t)(uintptr_t)&samplePending);
+	emitMem(jit, 0, false, 0x81, 7, RAX, 0);
+	emit32(jit, 0);
+	int skip = jump(jit, CC_E);
+	saveFrame(jit, ip);
+	callAddress(jit, takeSample);
+	patchHere(jit, skip);
+}
+
+// Instructions --------------------------------------------------------------------------------
+
+#define TOP_VALUE (-VALUE_SIZE)
+#define SECOND_VALUE (-2 * VALUE_SIZE)
+
+static int jumpOperand(uint8_t *code) { return (code[0] << 8) | code[1]; }
+
+// Virtual stack -------------------------------------------------------------------------------
+
+static int allocXmm(Jit *jit) {
+	for (int xmm = XMM_FIRST; xmm < XMM_COUNT; xmm++) {
+		if (!jit->xmmUsed[xmm]) {
+			jit->xmmUsed[xmm] = true;
+			return xmm;
+		}
+	}
+	// Unreachable, there are more registers than virtual values.
+	exit(1);
+}
+
+static void pushVirtual(Jit *jit, Virtual entry);
+static void flushVirtual(Jit *jit, int keep);
+
+static void pushConstant(Jit *jit, Value value, Value *source) {
+	Virtual entry = {VIRTUAL_CONSTANT, 0, value, source};
+	pushVirtual(jit, entry);
+}
+
+static void pushLocal(Jit *jit, int slot) {
+	Virtual entry = {VIRTUAL_LOCAL, slot, NIL_VAL, NULL};
+	pushVirtual(jit, entry);
+}
+
+static void pushNumber(Jit *jit, int xmm) {
+	Virtual entry = {VIRTUAL_NUMBER, xmm, NIL_VAL, NULL};
+	pushVirtual(jit, entry);
+}
+
+static void pushVirtual(Jit *jit, Virtual entry) {
+	if (jit->virtualCount == VIRTUAL_MAX)
+		flushVirtual(jit, 0);
+	jit->stack[jit->virtualCount++] = entry;
+}
+
+static Virtual *peekVirtual(Jit *jit, int distance) {
+	return &jit->stack[jit->virtualCount - 1 - distance];
+}
+
+static void dropVirtual(Jit *jit) {
+	Virtual *top = peekVirtual(jit, 0);
+	if (top->kind == VIRTUAL_NUMBER)
+		jit->xmmUsed[top->index] = false;
+	jit->virtualCount--;
+}
+
+// Writes a virtual value to [base + disp].
+static void materialize(Jit *jit, Virtual *entry, int base, int32_t disp) {
+	switch (entry->kind) {
+	case VIRTUAL_CONSTANT:
+		if (entry->source != NULL) {
+			movImm64(jit, RDX, (uint64_t)(uintptr_t)entry->source);
+			copyValue(jit, base, disp, RDX, 0);
+		} else {
+			storeValue(jit, base, disp, entry->value);
+		}
+		break;
+	case VIRTUAL_LOCAL:
+		copyValue(jit, base, disp, SLOTS, entry->index * VALUE_SIZE);
+		break;
+	case VIRTUAL_NUMBER:
+		storeNumber(jit, base, disp, entry->index);
+		break;
+	}
+}
+
+// Materializes all but the top `keep` virtual values onto the real stack.
+static void flushVirtual(Jit *jit, int keep) {
+	int count = jit->virtualCount - keep;
+	if (count <= 0)
+		return;
+	for (int i = 0; i < count; i++) {
+		materialize(jit, &jit->stack[i], TOP, i * VALUE_SIZE);
+		if (jit->stack[i].kind == VIRTUAL_NUMBER)
+			jit->xmmUsed[jit->stack[i].index] = false;
+	}
+	addImm(jit, TOP, count * VALUE_SIZE);
+	memmove(jit->stack, jit->stack + count, sizeof(Virtual) * keep);
+	jit->virtualCount = keep;
+}
+
+// Whether a virtual value can be an arithmetic operand, i.e. isn't a constant of another type.
+static bool numeric(Virtual *entry) {
+	return entry->kind != VIRTUAL_CONSTANT || IS_NUMBER(entry->value);
+}
+
+// Whether both top values are virtual and may be numbers.
+static bool numericOperands(Jit *jit) {
+	return jit->virtualCount >= 2 && numeric(peekVirtual(jit, 0)) && numeric(peekVirtual(jit, 1));
+}
+
+// Returns the xmm register holding the virtual number `entry`, loading it into `scratch` unless it
+// is already in one. A local that isn't a number leaves to the interpreter at `offset`.
+static int loadOperand(Jit *jit, Virtual *entry, int scratch, int offset) {
+	switch (entry->kind) {
+	case VIRTUAL_NUMBER:
+		return entry->index;
+	case VIRTUAL_CONSTANT: {
+		double number = AS_NUMBER(entry->value);
+		uint64_t word;
+		memcpy(&word, &number, sizeof(word));
+		movImm64(jit, RAX, word);
+		emitRegs(jit, 0x66, true, 0x0f6e, scratch, RAX); // movq xmm, rax
+		return scratch;
+	}
+	case VIRTUAL_LOCAL:
+		exitOn(jit, loadNumber(jit, scratch, SLOTS, entry->index * VALUE_SIZE), offset);
+		return scratch;
+	}
+	return scratch;
+}
+
+// Replaces the two virtual numbers on top with `a op b`, op being an SSE2 scalar double opcode.
+static void arithmeticVirtual(Jit *jit, int offset, int opcode) {
+	Virtual *b = peekVirtual(jit, 0);
+	Virtual *a = peekVirtual(jit, 1);
+	// A number in a register is overwritten with the result, anything else is loaded into a new
+	// one.
+	int result = a->kind == VIRTUAL_NUMBER ? a->index : allocXmm(jit);
+	loadOperand(jit, a, result, offset);
+	int operand = loadOperand(jit, b, XMM1, offset);
+	emitRegs(jit, 0xf2, false, opcode, result, operand);
+	if (b->kind == VIRTUAL_NUMBER)
+		jit->xmmUsed[b->index] = false;
+	jit->virtualCount -= 2;
+	pushNumber(jit, result);
+}
+
+// Compares the two virtual numbers on top and pops them, leaving the flags of
+// `swap ? b > a : a > b` for a seta or jbe.
+static void compareVirtual(Jit *jit, int offset, bool swap) {
+	// Only these two are left virtual, the flags are consumed by a branch or a store that doesn't
+	// get to materialize anything else.
+	flushVirtual(jit, 2);
+	int a = loadOperand(jit, peekVirtual(jit, 1), XMM0, offset);
+	int b = loadOperand(jit, peekVirtual(jit, 0), XMM1, offset);
+	if (swap) {
+		emitRegs(jit, 0x66, false, 0x0f2e, b, a); // ucomisd
+	} else {
+		emitRegs(jit, 0x66, false, 0x0f2e, a, b);
+	}
+	dropVirtual(jit);
+	dropVirtual(jit);
+}
+
+// Locals are stack slots, so the value declaring a local may itself still be virtual.
+static bool slotVirtual(Jit *jit, int offset, int slot) {
+	return slot >= jit->depths[offset] - jit->virtualCount;
+}
+
+// Stores the virtual value on top to a local, keeping it on the virtual stack.
+static bool setLocalVirtual(Jit *jit, int offset, int slot) {
+	if (jit->virtualCount == 0 || slotVirtual(jit, offset, slot))
+		return false;
+	// Virtual reads of the local must see the old value, they are left to the memory templates.
+	for (int i = 0; i < jit->virtualCount; i++) {
+		if (jit->stack[i].kind == VIRTUAL_LOCAL && jit->stack[i].index == slot)
+			return false;
+	}
+	materialize(jit, peekVirtual(jit, 0), SLOTS, slot * VALUE_SIZE);
+	return true;
+}
+
+// Instructions that work on the virtual stack. Returns false for one that needs the real stack.
+static bool emitVirtual(Jit *jit, int offset) {
+	Chunk *chunk = jit->chunk;
+	uint8_t *code = chunk->code + offset;
+	Value *constants = chunk->constants.values;
+
+	switch (genericOpcode(code[0])) {
+	case OP_CONSTANT: {
+		Value constant = constants[code[1]];
+		pushConstant(jit, constant, IS_OBJ(constant) ? &constants[code[1]] : NULL);
+		return true;
+	}
+	case OP_NIL:
+		pushConstant(jit, NIL_VAL, NULL);
+		return true;
+	case OP_TRUE:
+		pushConstant(jit, BOOL_VAL(true), NULL);
+		return true;
+	case OP_FALSE:
+		pushConstant(jit, BOOL_VAL(false), NULL);
+		return true;
+	case OP_GET_LOCAL:
+		if (slotVirtual(jit, offset, code[1]))
+			flushVirtual(jit, 0);
+		pushLocal(jit, code[1]);
+		return true;
+	case OP_POP:
+		if (jit->virtualCount == 0)
+			return false;
+		dropVirtual(jit);
+		return true;
+	case OP_SET_LOCAL:
+		return setLocalVirtual(jit, offset, code[1]);
+	case OP_SET_LOCAL_POP:
+		if (!setLocalVirtual(jit, offset, code[1]))
+			return false;
+		dropVirtual(jit);
+		return true;
+	case OP_ADD: {
+		// Unless one side is known to be a number this may well be a concatenation, which the
+		// memory template does without leaving.
+		if (!numericOperands(jit))
+			return false;
+		Virtual *a = peekVirtual(jit, 1);
+		Virtual *b = peekVirtual(jit, 0);
+		if (a->kind == VIRTUAL_LOCAL && b->kind == VIRTUAL_LOCAL)
+			return false;
+		arithmeticVirtual(jit, offset, 0x0f58);
+		return true;
+	}
+	case OP_ADD_CONSTANT: {
+		Value constant = constants[code[1]];
+		if (jit->virtualCount == 0 || !IS_NUMBER(constant) || !numeric(peekVirtual(jit, 0)))
+			return false;
+		// The operand is guarded while it is the only value pushed, a failing guard resumes at this
+		// instruction with just the operand on the stack.
+		Virtual *a = peekVirtual(jit, 0);
+		int result = a->kind == VIRTUAL_NUMBER ? a->index : allocXmm(jit);
+		loadOperand(jit, a, result, offset);
+		Virtual b = {VIRTUAL_CONSTANT, 0, constant, NULL};
+		int operand = loadOperand(jit, &b, XMM1, offset);
+		emitRegs(jit, 0xf2, false, 0x0f58, result, operand); // addsd
+		jit->virtualCount--;
+		pushNumber(jit, result);
+		return true;
+	}
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE: {
+		if (!numericOperands(jit))
+			return false;
+		int opcode = code[0] == OP_SUBTRACT ? 0x0f5c : code[0] == OP_MULTIPLY ? 0x0f59 : 0x0f5e;
+		arithmeticVirtual(jit, offset, opcode);
+		return true;
+	}
+	case OP_GREATER:
+	case OP_LESS:
+		if (!numericOperands(jit))
+			return false;
+		compareVirtual(jit, offset, code[0] == OP_LESS);
+		setcc(jit, CC_A, RAX);
+		storeBool(jit, TOP, 0);
+		addImm(jit, TOP, VALUE_SIZE);
+		return true;
+	case OP_LESS_JUMP_IF_FALSE:
+		if (!numericOperands(jit))
+			return false;
+		compareVirtual(jit, offset, true);
+		// Not b > a, which includes unordered.
+		addPatch(&jit->jumps, jump(jit, CC_BE), offset + 3 + jumpOperand(code + 1));
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Arithmetic on the two values on top of the stack, which have to be numbers.
+static void binaryNumbers(Jit *jit, int offset, int opcode) {
+	exitOn(jit, loadNumber(jit, XMM0, TOP, SECOND_VALUE), offset);
+	exitOn(jit, loadNumber(jit, XMM1, TOP, TOP_VALUE), offset);
+	emitRegs(jit, 0xf2, false, opcode, XMM0, XMM1);
+	storeNumber(jit, TOP, SECOND_VALUE, XMM0);
+	addImm(jit, TOP, -VALUE_SIZE);
+}
+
+// Comparison of the two numbers on top of the stack. `swap` compares b to a, so that a < b can be
+// tested as b > a, which is false when either is NaN.
+static void compareNumbers(Jit *jit, int offset, bool swap) {
+	exitOn(jit, loadNumber(jit, XMM0, TOP, SECOND_VALUE), offset);
+	exitOn(jit, loadNumber(jit, XMM1, TOP, TOP_VALUE), offset);
+	if (swap) {
+		emitRegs(jit, 0x66, false, 0x0f2e, XMM1, XMM0); // ucomisd xmm1, xmm0
+	} else {
+		emitRegs(jit, 0x66, false, 0x0f2e, XMM0, XMM1);
+	}
+	setcc(jit, CC_A, RAX);
+	storeBool(jit, TOP, SECOND_VALUE);
+	addImm(jit, TOP, -VALUE_SIZE);
+}
+
+// Adds the two values on top of the stack: numbers inline, anything else through jitAdd(), which
+// concatenates strings or reports the error.
+static void add(Jit *jit, uint8_t *next) {
+	int notNumber = loadNumber(jit, XMM0, TOP, SECOND_VALUE);
+	int notNumber2 = loadNumber(jit, XMM1, TOP, TOP_VALUE);
+	emitRegs(jit, 0xf2, false, 0x0f58, XMM0, XMM1);
+	storeNumber(jit, TOP, SECOND_VALUE, XMM0);
+	addImm(jit, TOP, -VALUE_SIZE);
+	int done = jump(jit, -1);
+	patchHere(jit, notNumber);
+	patchHere(jit, notNumber2);
+	saveFrame(jit, next);
+	callAddress(jit, jitAdd);
+	emitRegs(jit, 0, false, 0x84, RAX, RAX); // test al, al
+	addPatch(&jit->errors, jump(jit, CC_E), 0);
+	reloadTop(jit);
+	patchHere(jit, done);
+}
+
+static void emitInstruction(Jit *jit, int offset) {
+	Chunk *chunk = jit->chunk;
+	uint8_t *code = chunk->code + offset;
+	uint8_t *next = code + instructionLength(code[0]);
+	Value *constants = chunk->constants.values;
+
+	if (emitVirtual(jit, offset))
+		return;
+	flushVirtual(jit, 0);
+	switch (genericOpcode(code[0])) {
+	case OP_CONSTANT: {
+		Value constant = constants[code[1]];
+		if (IS_OBJ(constant)) {
+			// Read from the constant table rather than baked in, the code never holds a reference
+			// the collector can't see.
+			movImm64(jit, RDX, (uint64_t)(uintptr_t)&constants[code[1]]);
+			copyValue(jit, TOP, 0, RDX, 0);
+		} else {
+			storeValue(jit, TOP, 0, constant);
+		}
+		addImm(jit, TOP, VALUE_SIZE);
+		break;
+	}
+	case OP_NIL:
+		storeValue(jit, TOP, 0, NIL_VAL);
+		addImm(jit, TOP, VALUE_SIZE);
+		break;
+	case OP_TRUE:
+		storeValue(jit, TOP, 0, BOOL_VAL(true));
+		addImm(jit, TOP, VALUE_SIZE);
+		break;
+	case OP_FALSE:
+		storeValue(jit, TOP, 0, BOOL_VAL(false));
+		addImm(jit, TOP, VALUE_SIZE);
+		break;
+	case OP_POP:
+		addImm(jit, TOP, -VALUE_SIZE);
+		break;
+	case OP_GET_LOCAL:
+		copyValue(jit, TOP, 0, SLOTS, code[1] * VALUE_SIZE);
+		addImm(jit, TOP, VALUE_SIZE);
+		break;
+	case OP_SET_LOCAL:
+		copyValue(jit, SLOTS, code[1] * VALUE_SIZE, TOP, TOP_VALUE);
+		break;
+	case OP_SET_LOCAL_POP:
+		addImm(jit, TOP, -VALUE_SIZE);
+		copyValue(jit, SLOTS, code[1] * VALUE_SIZE, TOP, 0);
+		break;
+	case OP_GET_GLOBAL: {
+		// Undefined globals are left to the interpreter, which reports them.
+		int32_t slot = jumpOperand(code + 1) * VALUE_SIZE;
+		load64(jit, RDX, VM_REG, (int32_t)offsetof(VM, globalValues.values));
+		exitOn(jit, jumpIfUndefined(jit, RDX, slot), offset);
+		copyValue(jit, TOP, 0, RDX, slot);
+		addImm(jit, TOP, VALUE_SIZE);
+		break;
+	}
+	case OP_SET_GLOBAL: {
+		int32_t slot = jumpOperand(code + 1) * VALUE_SIZE;
+		load64(jit, RDX, VM_REG, (int32_t)offsetof(VM, globalValues.values));
+		exitOn(jit, jumpIfUndefined(jit, RDX, slot), offset);
+		// Only objects can be young, everything else is stored without the write barrier.
+		int object = jumpIfObject(jit, TOP, TOP_VALUE);
+		copyValue(jit, RDX, slot, TOP, TOP_VALUE);
+		int done = jump(jit, -1);
+		patchHere(jit, object);
+		saveFrame(jit, next);
+		movImm32(jit, RDI, (uint32_t)jumpOperand(code + 1));
+		callAddress(jit, jitSetGlobal);
+		patchHere(jit, done);
+		break;
+	}
+	case OP_DEFINE_GLOBAL:
+		saveFrame(jit, next);
+		movImm32(jit, RDI, (uint32_t)jumpOperand(code + 1));
+		callAddress(jit, jitDefineGlobal);
+		reloadTop(jit);
+		break;
+	case OP_EQUAL: {
+		int notNumber = loadNumber(jit, XMM0, TOP, SECOND_VALUE);
+		int notNumber2 = loadNumber(jit, XMM1, TOP, TOP_VALUE);
+		emitRegs(jit, 0x66, false, 0x0f2e, XMM0, XMM1);
+		// Equal and ordered, NaN is not equal to itself.
+		setcc(jit, CC_E, RAX);
+		setcc(jit, CC_NP, RCX);
+		emitRegs(jit, 0, false, 0x20, RCX, RAX); // and al, cl
+		storeBool(jit, TOP, SECOND_VALUE);
+		addImm(jit, TOP, -VALUE_SIZE);
+		int done = jump(jit, -1);
+		patchHere(jit, notNumber);
+		patchHere(jit, notNumber2);
+		saveFrame(jit, next);
+		callAddress(jit, jitEqual);
+		reloadTop(jit);
+		patchHere(jit, done);
+		break;
+	}
+	case OP_GREATER:
+		compareNumbers(jit, offset, false);
+		break;
+	case OP_LESS:
+		compareNumbers(jit, offset, true);
+		break;
+	case OP_ADD:
+		add(jit, next);
+		break;
+	case OP_SUBTRACT:
+		binaryNumbers(jit, offset, 0x0f5c);
+		break;
+	case OP_MULTIPLY:
+		binaryNumbers(jit, offset, 0x0f59);
+		break;
+	case OP_DIVIDE:
+		binaryNumbers(jit, offset, 0x0f5e);
+		break;
+	case OP_NOT:
+		testFalsey(jit, TOP, TOP_VALUE);
+		storeBool(jit, TOP, TOP_VALUE);
+		break;
+	case OP_NEGATE:
+		// Flip the sign bit.
+		exitOn(jit, loadNumber(jit, XMM0, TOP, TOP_VALUE), offset);
+		emitRegs(jit, 0x66, true, 0x0f7e, XMM0, RAX); // movq rax, xmm0
+		emitRegs(jit, 0, true, 0x0fba, 7, RAX);		  // btc rax, 63
+		emitByte(jit, 63);
+#ifdef NAN_BOXING
+		store64(jit, TOP, TOP_VALUE, RAX);
+#else
+		store64(jit, TOP, TOP_VALUE + (int32_t)offsetof(Value, as), RAX);
+#endif
+		break;
+	case OP_PRINT:
+		saveFrame(jit, next);
+		callAddress(jit, jitPrint);
+		reloadTop(jit);
+		break;
+	case OP_JUMP:
+		addPatch(&jit->jumps, jump(jit, -1), offset + 3 + jumpOperand(code + 1));
+		break;
+	case OP_JUMP_IF_FALSE:
+		testFalsey(jit, TOP, TOP_VALUE);
+		emitRegs(jit, 0, false, 0x84, RAX, RAX); // test al, al
+		addPatch(&jit->jumps, jump(jit, CC_NE), offset + 3 + jumpOperand(code + 1));
+		break;
+	case OP_LOOP:
+		safepoint(jit, next);
+		addPatch(&jit->jumps, jump(jit, -1), offset + 3 - jumpOperand(code + 1));
+		break;
+	case OP_CALL: {
+		safepoint(jit, next);
+		saveFrame(jit, next);
+		int32_t callee = -(code[1] + 1) * VALUE_SIZE;
+		// Same callee as last time, compiled, and room for its frame: push the frame right here,
+		// everything else goes through jitCall().
+		movImm64(jit, RSI, (uint64_t)(uintptr_t)&chunk->callCaches[jumpOperand(code + 2)]);
+		load64(jit, RSI, RSI, (int32_t)offsetof(CallCache, callee));
+#ifdef NAN_BOXING
+		movImm64(jit, RCX, QNAN | SIGN_BIT);
+		emitRegs(jit, 0, true, 0x09, RSI, RCX); // or rcx, rsi
+		load64(jit, RAX, TOP, callee);
+		emitRegs(jit, 0, true, 0x39, RCX, RAX); // cmp rax, rcx
+		int slow = jump(jit, CC_NE);
+#else
+		emitMem(jit, 0, false, 0x81, 7, TOP, callee + (int32_t)offsetof(Value, type));
+		emit32(jit, VAL_OBJ);
+		int slow = jump(jit, CC_NE);
+		emitMem(jit, 0, true, 0x39, RSI, TOP, callee + (int32_t)offsetof(Value, as)); // cmp [], rsi
+		int slow2 = jump(jit, CC_NE);
+#endif
+		load64(jit, RDI, RSI, (int32_t)offsetof(ObjFunction, jit));
+		emitRegs(jit, 0, true, 0x85, RDI, RDI); // test rdi, rdi
+		int slow3 = jump(jit, CC_E);
+		// cmp rsp, []
+		emitMem(jit, 0, true, 0x3b, RSP, VM_REG, (int32_t)offsetof(VM, jitStackLimit));
+		int slow4 = jump(jit, CC_BE);
+		emitMem(jit, 0, false, 0x8b, RAX, VM_REG, (int32_t)offsetof(VM, frameCount));
+		emitMem(jit, 0, false, 0x3b, RAX, VM_REG, (int32_t)offsetof(VM, frameCapacity));
+		int slow5 = jump(jit, CC_GE);
+		// The frame's end, slots + frameBytes, against the stack's.
+		lea(jit, RDX, TOP, callee);
+		load64(jit, RCX, RDI, (int32_t)offsetof(JitCode, frameBytes));
+		emitRegs(jit, 0, true, 0x01, RDX, RCX); // add rcx, rdx
+		emitMem(jit, 0, true, 0x63, R8, VM_REG, (int32_t)offsetof(VM, stackCapacity)); // movsxd
+		emitRegs(jit, 0, true, 0x69, R8, R8);											 // imul
+		emit32(jit, VALUE_SIZE);
+		emitMem(jit, 0, true, 0x03, R8, VM_REG, (int32_t)offsetof(VM, stack)); // add r8, []
+		emitRegs(jit, 0, true, 0x39, R8, RCX);									 // cmp rcx, r8
+		int slow6 = jump(jit, CC_A);
+		// frames[frameCount++] = {function, its code, slots}, and it becomes this code's frame.
+		emitMem(jit, 0, false, 0x8d, RCX, RAX, 1); // lea ecx, [rax + 1]
+		emitMem(jit, 0, false, 0x89, RCX, VM_REG, (int32_t)offsetof(VM, frameCount));
+		emitRegs(jit, 0, true, 0x69, RAX, RAX); // imul rax, rax, imm
+		emit32(jit, sizeof(CallFrame));
+		emitMem(jit, 0, true, 0x03, RAX, VM_REG, (int32_t)offsetof(VM, frames)); // add rax, []
+		emitRegs(jit, 0, true, 0x89, RAX, FRAME);								   // mov rbx, rax
+		store64(jit, FRAME, (int32_t)offsetof(CallFrame, function), RSI);
+		load64(jit, RAX, RSI, (int32_t)offsetof(ObjFunction, chunk.code));
+		store64(jit, FRAME, (int32_t)offsetof(CallFrame, ip), RAX);
+		store64(jit, FRAME, (int32_t)offsetof(CallFrame, slots), RDX);
+		emitRegs(jit, 0, true, 0x89, RDX, SLOTS); // mov r12, rdx
+		emitRegs(jit, 0, true, 0x89, RDI, RAX);	  // mov rax, rdi
+		int pushed = jump(jit, -1);
+
+		patchHere(jit, slow);
+#ifndef NAN_BOXING
+		patchHere(jit, slow2);
+#endif
+		patchHere(jit, slow3);
+		patchHere(jit, slow4);
+		patchHere(jit, slow5);
+		patchHere(jit, slow6);
+		movImm32(jit, RDI, code[1]);
+		movImm64(jit, RSI, (uint64_t)(uintptr_t)&chunk->callCaches[jumpOperand(code + 2)]);
+		callAddress(jit, jitCall);
+		emitRegs(jit, 0, false, 0x85, RAX, RAX); // test eax, eax
+		addPatch(&jit->errors, jump(jit, CC_E), 0);
+		emitRegs(jit, 0, false, 0x81, 7, RAX); // cmp eax, imm
+		emit32(jit, JIT_CALL_PUSHED);
+		int done = jump(jit, CC_NE);
+		loadFrame(jit);
+		load64(jit, RAX, FRAME, (int32_t)offsetof(CallFrame, function));
+		load64(jit, RAX, RAX, (int32_t)offsetof(ObjFunction, jit));
+		// A compiled callee is called directly, on this code's registers.
+		patchHere(jit, pushed);
+		addImm(jit, RSP, -8);
+		emitMem(jit, 0, false, 0xff, 2, RAX, (int32_t)offsetof(JitCode, start)); // call []
+		addImm(jit, RSP, 8);
+		emitRegs(jit, 0, false, 0x85, RAX, RAX);
+		int returned = jump(jit, CC_E);
+		emitRegs(jit, 0, false, 0x89, RAX, RDI); // mov edi, eax
+		callAddress(jit, jitResume);
+		emitRegs(jit, 0, false, 0x84, RAX, RAX); // test al, al
+		addPatch(&jit->errors, jump(jit, CC_E), 0);
+		patchHere(jit, returned);
+		patchHere(jit, done);
+		loadFrame(jit);
+		break;
+	}
+	case OP_TAIL_CALL: {
+		safepoint(jit, next);
+		saveFrame(jit, next);
+		movImm32(jit, RDI, code[1]);
+		movImm64(jit, RSI, (uint64_t)(uintptr_t)&chunk->callCaches[jumpOperand(code + 2)]);
+		callAddress(jit, jitTailCall);
+		emitRegs(jit, 0, false, 0x85, RAX, RAX); // test eax, eax
+		addPatch(&jit->errors, jump(jit, CC_E), 0);
+		emitRegs(jit, 0, false, 0x81, 7, RAX); // cmp eax, imm
+		emit32(jit, JIT_CALL_REPLACED);
+		int native = jump(jit, CC_NE);
+		// The frame now runs the callee: jump to its code when it has some, otherwise whoever
+		// called this code runs it.
+		loadFrame(jit);
+		load64(jit, RAX, FRAME, (int32_t)offsetof(CallFrame, function));
+		load64(jit, RAX, RAX, (int32_t)offsetof(ObjFunction, jit));
+		emitRegs(jit, 0, true, 0x85, RAX, RAX); // test rax, rax
+		int interpreted = jump(jit, CC_E);
+		emitMem(jit, 0, false, 0xff, 4, RAX, (int32_t)offsetof(JitCode, start)); // jmp []
+		patchHere(jit, interpreted);
+		leave(jit, JIT_TAIL_CALL);
+		patchHere(jit, native);
+		reloadTop(jit);
+		break;
+	}
+	case OP_RETURN: {
+		safepoint(jit, next);
+		emitMem(jit, 0, false, 0xff, 1, VM_REG, (int32_t)offsetof(VM, frameCount)); // dec dword []
+		int caller = jump(jit, CC_NE);
+		// The script itself returned, pop its result as run() does.
+		lea(jit, RAX, TOP, TOP_VALUE);
+		store64(jit, VM_REG, (int32_t)offsetof(VM, stackTop), RAX);
+		int done = jump(jit, -1);
+		patchHere(jit, caller);
+		// The result replaces the callee and its arguments.
+		copyValue(jit, SLOTS, 0, TOP, TOP_VALUE);
+		lea(jit, RAX, SLOTS, VALUE_SIZE);
+		store64(jit, VM_REG, (int32_t)offsetof(VM, stackTop), RAX);
+		patchHere(jit, done);
+		leave(jit, JIT_RETURNED);
+		break;
+	}
+	case OP_ADD_LOCALS: {
+		int notNumber = loadNumber(jit, XMM0, SLOTS, code[1] * VALUE_SIZE);
+		int notNumber2 = loadNumber(jit, XMM1, SLOTS, code[2] * VALUE_SIZE);
+		emitRegs(jit, 0xf2, false, 0x0f58, XMM0, XMM1);
+		storeNumber(jit, TOP, 0, XMM0);
+		addImm(jit, TOP, VALUE_SIZE);
+		int done = jump(jit, -1);
+		// Push both and take the generic path.
+		patchHere(jit, notNumber);
+		patchHere(jit, notNumber2);
+		copyValue(jit, TOP, 0, SLOTS, code[1] * VALUE_SIZE);
+		copyValue(jit, TOP, VALUE_SIZE, SLOTS, code[2] * VALUE_SIZE);
+		addImm(jit, TOP, 2 * VALUE_SIZE);
+		add(jit, next);
+		patchHere(jit, done);
+		break;
+	}
+	case OP_LESS_JUMP_IF_FALSE:
+		exitOn(jit, loadNumber(jit, XMM0, TOP, SECOND_VALUE), offset);
+		exitOn(jit, loadNumber(jit, XMM1, TOP, TOP_VALUE), offset);
+		addImm(jit, TOP, -2 * VALUE_SIZE);
+		emitRegs(jit, 0x66, false, 0x0f2e, XMM1, XMM0); // ucomisd xmm1, xmm0
+		// Not b > a, which includes unordered.
+		addPatch(&jit->jumps, jump(jit, CC_BE), offset + 3 + jumpOperand(code + 1));
+		break;
+	case OP_ADD_CONSTANT: {
+		Value constant = constants[code[1]];
+		if (IS_NUMBER(constant)) {
+			int notNumber = loadNumber(jit, XMM0, TOP, TOP_VALUE);
+			double number = AS_NUMBER(constant);
+			uint64_t word;
+			memcpy(&word, &number, sizeof(word));
+			movImm64(jit, RAX, word);
+			emitRegs(jit, 0x66, true, 0x0f6e, XMM1, RAX); // movq xmm1, rax
+			emitRegs(jit, 0xf2, false, 0x0f58, XMM0, XMM1);
+			storeNumber(jit, TOP, TOP_VALUE, XMM0);
+			int done = jump(jit, -1);
+			patchHere(jit, notNumber);
+			storeValue(jit, TOP, 0, constant);
+			addImm(jit, TOP, VALUE_SIZE);
+			add(jit, next);
+			patchHere(jit, done);
+		} else {
+			movImm64(jit, RDX, (uint64_t)(uintptr_t)&constants[code[1]]);
+			copyValue(jit, TOP, 0, RDX, 0);
+			addImm(jit, TOP, VALUE_SIZE);
+			add(jit, next);
+		}
+		break;
+	}
+	default:
+		// No template, the interpreter runs it.
+		exitOn(jit, jump(jit, -1), offset);
+		break;
+	}
+}
+
+// The entry from C: saves the callee-saved registers, sets them up for the top frame and calls the
+// instruction address passed in rdi.
+static void emitPrologue(Jit *jit) {
+	pushReg(jit, RBX);
+	pushReg(jit, RBP);
+	pushReg(jit, R12);
+	pushReg(jit, R13);
+	pushReg(jit, R14);
+	pushReg(jit, R15);
+	movImm64(jit, VM_REG, (uint64_t)(uintptr_t)&vm);
+#ifdef NAN_BOXING
+	movImm64(jit, R15, QNAN);
+#endif
+	loadFrame(jit);
+	// Six pushes and this call's return address keep rsp 16-byte aligned in the templates, ready
+	// for their helper calls.
+	emitRegs(jit, 0, false, 0xff, 2, RDI); // call rdi
+	popReg(jit, R15);
+	popReg(jit, R14);
+	popReg(jit, R13);
+	popReg(jit, R12);
+	popReg(jit, RBP);
+	popReg(jit, RBX);
+	emitByte(jit, 0xc3); // ret
+}
+
+// Exit stubs shared by every branch leaving from the same instruction: write the stack top back,
+// point the frame at the instruction and let the interpreter run it.
+static void emitExits(Jit *jit) {
+	int count = jit->chunk->count;
+	int *stubs = malloc(sizeof(int) * (count + 1));
+	if (stubs == NULL)
+		exit(1);
+	for (int i = 0; i <= count; i++)
+		stubs[i] = -1;
+	for (int i = 0; i < jit->exits.count; i++) {
+		Patch *patch = &jit->exits.items[i];
+		if (stubs[patch->target] == -1) {
+			stubs[patch->target] = jit->count;
+			saveFrame(jit, jit->chunk->code + patch->target);
+			leave(jit, JIT_EXITED);
+		}
+		patchTo(jit, patch->at, stubs[patch->target]);
+	}
+	free(stubs);
+
+	for (int i = 0; i < jit->deoptCount; i++) {
+		Deopt *deopt = &jit->deopts[i];
+		patchHere(jit, deopt->at);
+		for (int j = 0; j < deopt->count; j++)
+			materialize(jit, &deopt->stack[j], TOP, j * VALUE_SIZE);
+		addImm(jit, TOP, deopt->count * VALUE_SIZE);
+		saveFrame(jit, jit->chunk->code + deopt->offset);
+		leave(jit, JIT_EXITED);
+	}
+
+	if (jit->errors.count > 0) {
+		int error = jit->count;
+		leave(jit, JIT_ERROR);
+		for (int i = 0; i < jit->errors.count; i++)
+			patchTo(jit, jit->errors.items[i].at, error);
+	}
+}
+
+bool jitCompile(ObjFunction *function) {
+	Jit jit;
+	memset(&jit, 0, sizeof(jit));
+	jit.function = function;
+	jit.chunk = &function->chunk;
+	int count = jit.chunk->count;
+	jit.entries = malloc(sizeof(int) * (count + 1));
+	if (jit.entries == NULL)
+		exit(1);
+	jit.depths = stackDepths(jit.chunk, function->arity + 1);
+	jit.targets = calloc(count + 1, sizeof(bool));
+	if (jit.targets == NULL)
+		exit(1);
+	for (int i = 0; i <= count; i++)
+		jit.entries[i] = -1;
+	// Where the function starts, jumps land and so where run() enters at a loop.
+	jit.targets[0] = true;
+	for (int offset = 0; offset < count;
+		 offset += instructionLength(jit.chunk->code[offset])) {
+		uint8_t *code = jit.chunk->code + offset;
+		int target = -1;
+		if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE || code[0] == OP_LESS_JUMP_IF_FALSE)
+			target = offset + 3 + jumpOperand(code + 1);
+		if (code[0] == OP_LOOP)
+			target = offset + 3 - jumpOperand(code + 1);
+		if (target >= 0 && target <= count)
+			jit.targets[target] = true;
+	}
+
+	emitPrologue(&jit);
+	for (int offset = 0; offset < count;
+		 offset += instructionLength(jit.chunk->code[offset])) {
+		if (jit.targets[offset])
+			flushVirtual(&jit, 0);
+		// Only entered where nothing is virtual.
+		if (jit.virtualCount == 0)
+			jit.entries[offset] = jit.count;
+		emitInstruction(&jit, offset);
+	}
+	flushVirtual(&jit, 0);
+	emitExits(&jit);
+
+	bool compiled = true;
+	for (int i = 0; i < jit.jumps.count; i++) {
+		int target = jit.jumps.items[i].target;
+		if (target < 0 || target >= count || jit.entries[target] == -1) {
+			compiled = false;
+			break;
+		}
+		patchTo(&jit, jit.jumps.items[i].at, jit.entries[target]);
+	}
+
+	uint8_t *code = MAP_FAILED;
+	if (compiled) {
+		// Written while writable, then flipped to executable, never both at once.
+		code = mmap(NULL, jit.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (code != MAP_FAILED) {
+			memcpy(code, jit.code, jit.count);
+			if (mprotect(code, jit.count, PROT_READ | PROT_EXEC) != 0) {
+				munmap(code, jit.count);
+				code = MAP_FAILED;
+			}
+		}
+	}
+
+	free(jit.code);
+	free(jit.jumps.items);
+	free(jit.exits.items);
+	free(jit.errors.items);
+	free(jit.targets);
+	FREE_ARRAY(int, jit.depths, count);
+	free(jit.deopts);
+	if (code == MAP_FAILED) {
+		free(jit.entries);
+		return false;
+	}
+	JitCode *compiledCode = malloc(sizeof(JitCode));
+	if (compiledCode == NULL)
+		exit(1);
+	compiledCode->code = code;
+	compiledCode->size = jit.count;
+	compiledCode->entries = jit.entries;
+	compiledCode->start = code + jit.entries[0];
+	compiledCode->frameBytes = sizeof(Value) * frameSize(function);
+	function->jit = compiledCode;
+	return true;
+}
+
+JitResult jitEnter(ObjFunction *function, uint8_t *ip) {
+	JitResult result;
+	for (;;) {
+		JitCode *jit = function->jit;
+		// Instructions in the middle of an expression have no entry, see emitVirtual().
+		int entry = jit->entries[ip - function->chunk.code];
+		if (entry == -1)
+			return JIT_EXITED;
+		result = ((JitResult(*)(uint8_t *))jit->code)(jit->code + entry);
+		if (result != JIT_TAIL_CALL)
+			break;
+		// Tail calls loop here instead of nesting, like they do in run().
+		function = vm.frames[vm.frameCount - 1].function;
+		ip = function->chunk.code;
+		if (!jitWarm(function)) {
+			result = JIT_EXITED;
+			break;
+		}
+	}
+	return result;
+}
+
+void jitFree(JitCode *code) {
+	if (code == NULL)
+		return;
+	munmap(code->code, code->size);
+	free(code->entries);
+	free(code);
+}
+#endif
@@ -0,0 +1,94 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// Baseline template compiler: once a function is hot its bytecode is translated instruction by
+// instruction into x86-64 machine code that does the same thing to the same value stack. The
+// interpreter and the native code hand a frame back and forth at instruction boundaries, so a
+// frame can start in run(), continue natively from a loop header and drop back into run() when it
+// reaches something the templates leave to the interpreter, such as a runtime error.
+
+// Calls plus loop back edges after which a function is compiled.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+// Native frames nest on the C stack, a compiled callee is called directly by its compiled caller.
+// Once they use this many bytes of it calls are left to the interpreter, which runs any depth of
+// Lox calls in one C frame.
+#define JIT_STACK_MAX (1024 * 1024)
+
+typedef enum {
+	// The frame returned, its result is on the caller's stack.
+	JIT_RETURNED,
+	// The frame is still on top, run() carries on from its ip.
+	JIT_EXITED,
+	// A runtime error was reported and the stack reset.
+	JIT_ERROR,
+	// A tail call replaced the frame's function, it is still on top and runs from its start.
+	JIT_TAIL_CALL,
+} JitResult;
+
+typedef struct JitCode {
+	// Executable mapping holding the prologue, every instruction's template and the exit stubs.
+	uint8_t *code;
+	size_t size;
+	// Bytecode offset -> offset of its template in code, -1 for bytes inside an instruction. Lets
+	// run() enter at any instruction, e.g. a loop header.
+	int *entries;
+	// Template of the first instruction, where compiled callers call the function. Like every
+	// template it runs on the caller's registers and returns a JitResult.
+	uint8_t *start;
+	// frameSize() in bytes, checked against the stack's capacity by compiled callers.
+	size_t frameBytes;
+} JitCode;
+
+// Compiles function, leaving the code in function->jit. False if it can't be compiled.
+bool jitCompile(ObjFunction *function);
+// Runs the top frame, whose function is compiled, natively from the instruction at ip.
+JitResult jitEnter(ObjFunction *function, uint8_t *ip);
+void jitFree(JitCode *code);
+
+// Whether native code may be entered, i.e. the C stack has room for more native frames.
+static inline bool jitStackFits() {
+	return (uintptr_t)__builtin_frame_address(0) > vm.jitStackLimit;
+}
+
+// Counts a call or loop iteration of function and compiles it once that makes it hot. True when
+// function has native code.
+static inline bool jitWarm(ObjFunction *function) {
+	if (function->jit != NULL)
+		return true;
+	if (function->hotness >= JIT_THRESHOLD || ++function->hotness < JIT_THRESHOLD)
+		return false;
+	return jitCompile(function);
+}
+
+// Runtime support the generated code calls, defined in vm.c next to the interpreter code they
+// mirror. Each works on vm.stackTop and the frame's ip, which the code stores first.
+// Both calls return one of the JIT_CALL_ results.
+int jitCall(int argCount, CallCache *cache);
+int jitTailCall(int argCount, CallCache *cache);
+// Finishes the top frame after a direct call from native code came back without returning from it.
+bool jitResume(JitResult result);
+bool jitAdd();
+void jitEqual();
+void jitPrint();
+void jitDefineGlobal(int slot);
+void jitSetGlobal(int slot);
+
+#define JIT_CALL_ERROR 0
+// The call has returned, its result is on the stack.
+#define JIT_CALL_DONE 1
+// The frame now belongs to the callee, ip at its first instruction.
+#define JIT_CALL_REPLACED 2
+// A frame was pushed for a compiled callee, the caller calls its start.
+#define JIT_CALL_PUSHED 3
+
+#endif
+
+#endif
@@ -1,11 +1,22 @@
+#include "bytecache.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "sampler.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Whether scripts are loaded from and compiled into their bytecode cache. maindump prints the
+// listing while compiling, so it always compiles.
+#ifdef DEBUG_PRINT_CODE
+static bool useCache = false;
+#else
+static bool useCache = true;
+#endif
+
 static void repl() {
 	char line[1024];
 	for (;;) {
@@ -41,9 +52,32 @@ static char *readFile(const char *path) {
 	fclose(file);
 	return buffer;
 }
+// The compiled form of script.lox is cached in script.loxc.
+static char *cachePath(const char *path) {
+	size_t length = strlen(path);
+	char *cache = (char *)malloc(length + 2);
+	if (cache == NULL) {
+		fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+		exit(74);
+	}
+	memcpy(cache, path, length);
+	cache[length] = 'c';
+	cache[length + 1] = '\0';
+	return cache;
+}
+
 static void runFile(const char *path) {
 	char *source = readFile(path);
-	InterpretResult result = interpret(source);
+	char *cache = cachePath(path);
+	ObjFunction *script = useCache ? loadBytecode(cache, source) : NULL;
+	if (script == NULL) {
+		script = compile(source);
+		if (script != NULL && useCache)
+			saveBytecode(cache, source, script);
+	}
+	free(cache);
+	InterpretResult result =
+		script == NULL ? INTERPRET_COMPILE_ERROR : interpretFunction(script);
 	free(source);
 	if (result == INTERPRET_COMPILE_ERROR)
 		exit(65);
@@ -56,12 +90,32 @@ int main(int argc, const char *argv[]) {
 	// And this caused a segmentation fault because we were de-referencing the vm.stackTop which was
 	// a null pointer
 	initVM();
-	if (argc == 1) {
+	// Options come before the script path.
+	int arg = 1;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		if (strcmp(argv[arg], "--backend=register") == 0) {
+			vm.backend = BACKEND_REGISTER;
+		} else if (strcmp(argv[arg], "--backend=stack") == 0) {
+			vm.backend = BACKEND_STACK;
+		} else if (strcmp(argv[arg], "--no-cache") == 0) {
+			useCache = false;
+		} else if (strncmp(argv[arg], "--profile=", 10) == 0) {
+			if (!startSampler(argv[arg] + 10)) {
+				fprintf(stderr, "Could not start the sampling profiler.\n");
+				exit(74);
+			}
+		} else {
+			fprintf(stderr, "Unknown option \"%s\".\n", argv[arg]);
+			exit(64);
+		}
+	}
+	if (arg == argc) {
 		repl();
-	} else if (argc == 2) {
-		runFile(argv[1]);
+	} else if (arg == argc - 1) {
+		runFile(argv[arg]);
 	} else {
-		fprintf(stderr, "Usage: clox [path]\n");
+		fprintf(stderr, "Usage: clox [--backend=stack|register] [--no-cache] "
+						"[--profile=out.folded] [path]\n");
 		exit(64);
 	}
 	freeVM();
@@ -1,9 +1,29 @@
 #include "memory.h"
+#include "bytecache.h"
+#include "compiler.h"
+#include "jit.h"
 #include "object.h"
+#include "table.h"
 #include "vm.h"
 #include <stdlib.h>
 
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#include <stdio.h>
+#endif
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+	// Every heap allocation goes through here, so this is where the collector gets paced.
+	vm.bytesAllocated += newSize - oldSize;
+	if (newSize > oldSize) {
+#ifdef DEBUG_STRESS_GC
+		collectGarbage();
+#endif
+		if (vm.bytesAllocated > vm.nextGC) {
+			collectGarbage();
+		}
+	}
+
 	if (newSize == 0) {
 		free(pointer);
 		return NULL;
@@ -17,23 +37,298 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
 	return result;
 }
 
+void initNursery() {
+	// Not counted in bytesAllocated, the nursery is a fixed cost rather than heap growth.
+	vm.nurseryStart = (uint8_t *)malloc(NURSERY_SIZE);
+	if (vm.nurseryStart == NULL)
+		exit(1);
+	vm.nurseryTop = vm.nurseryStart;
+	vm.nurseryEnd = vm.nurseryStart + NURSERY_SIZE;
+	vm.rememberedCount = 0;
+	vm.rememberedCapacity = 0;
+	vm.remembered = NULL;
+}
+
+void freeNursery() {
+	free(vm.nurseryStart);
+	free(vm.remembered);
+	vm.nurseryStart = vm.nurseryTop = vm.nurseryEnd = NULL;
+}
+
+// Keeps every young object 8-byte aligned.
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// Returns NULL when the object is too big for the nursery, the caller then allocates it in the
+// old space. Otherwise it's a pointer bump, with a minor collection first if the nursery is full.
+void *allocateYoung(size_t size) {
+	size = NURSERY_ALIGN(size);
+	if (size > NURSERY_SIZE / 8)
+		return NULL;
+#ifdef DEBUG_STRESS_GC
+	collectNursery();
+#endif
+	if (vm.nurseryTop + size > vm.nurseryEnd) {
+		collectNursery();
+	}
+	void *result = vm.nurseryTop;
+	vm.nurseryTop += size;
+	return result;
+}
+
+void rememberSlot(ValueArray *array, int index) {
+	// Plain malloc memory like the gray stack, the barrier runs in places that can't collect.
+	if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+		vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+		vm.remembered = (RememberedSlot *)realloc(vm.remembered,
+												  sizeof(RememberedSlot) * vm.rememberedCapacity);
+		if (vm.remembered == NULL)
+			exit(1);
+	}
+	vm.remembered[vm.rememberedCount].array = array;
+	vm.remembered[vm.rememberedCount].index = index;
+	vm.rememberedCount++;
+}
+
+// Drops remembered slots inside an array that is about to be freed.
+static void forgetSlots(ValueArray *array) {
+	for (int i = 0; i < vm.rememberedCount; i++) {
+		if (vm.remembered[i].array == array)
+			vm.remembered[i].array = NULL;
+	}
+}
+
+// Returns where a young object lives after the minor collection, copying it out on first sight.
+// Strings are the only young objects and hold no references, so there's nothing to scan inside
+// the copy.
+static Value evacuate(Value value) {
+	if (!IS_YOUNG_VALUE(value))
+		return value;
+	Obj *object = AS_OBJ(value);
+	// Already copied through another root, `next` is the forwarding address.
+	if (object->isMarked)
+		return OBJ_VAL(object->next);
+	// The copy allocates in the old space, which can run a full collection in the middle of this
+	// one. Full collections leave young objects alone, and every copy made so far is already
+	// reachable from the root it was stored into.
+	Obj *copy = (Obj *)promoteString((ObjString *)object);
+	object->isMarked = true;
+	object->next = copy;
+	return OBJ_VAL(copy);
+}
+
+// Minor collection: copies the live young objects into the old space and empties the nursery.
+// Only the stack and the remembered slots are roots. Dead young objects are never visited, apart
+// from their entries in the intern table.
+void collectNursery() {
+#ifdef DEBUG_LOG_GC
+	printf("-- minor gc begin (%zu bytes young)\n", (size_t)(vm.nurseryTop - vm.nurseryStart));
+#endif
+	for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+		*slot = evacuate(*slot);
+	}
+	for (int i = 0; i < vm.rememberedCount; i++) {
+		RememberedSlot *remembered = &vm.remembered[i];
+		if (remembered->array != NULL) {
+			remembered->array->values[remembered->index] =
+				evacuate(remembered->array->values[remembered->index]);
+		}
+	}
+	vm.rememberedCount = 0;
+
+	// vm.strings is weak. Survivors keep their entry under the new address, which hashes the same,
+	// the rest become tombstones.
+	for (int i = 0; i < vm.strings.capacity; i++) {
+		Entry *entry = &vm.strings.entries[i];
+		if (entry->key != NULL && IS_YOUNG(entry->key)) {
+			if (entry->key->obj.isMarked) {
+				entry->key = (ObjString *)entry->key->obj.next;
+			} else {
+				// The dead string's header is still intact until the nursery is reset.
+				tableDelete(&vm.strings, entry->key);
+			}
+		}
+	}
+
+	vm.nurseryTop = vm.nurseryStart;
+#ifdef DEBUG_LOG_GC
+	printf("-- minor gc end\n");
+#endif
+}
+
 static void freeObject(Obj *object) {
+#ifdef DEBUG_LOG_GC
+	printf("%p free type %d\n", (void *)object, object->type);
+#endif
 	switch (object->type) {
 	case OBJ_FUNCTION: {
 		ObjFunction *function = (ObjFunction *)object;
+		forgetSlots(&function->chunk.constants);
 		freeChunk(&function->chunk);
+		freeChunk(&function->regChunk);
+#ifdef JIT
+		jitFree(function->jit);
+#endif
 		FREE(ObjFunction, object);
 		break;
 	}
+	case OBJ_ROPE:
+		FREE(ObjRope, object);
+		break;
+	case OBJ_NATIVE:
+		FREE(ObjNative, object);
+		break;
 	case OBJ_STRING: {
 		ObjString *string = (ObjString *)object;
-		FREE_ARRAY(char, string->chars, string->length + 1);
-		FREE(ObjString, object);
+		reallocate(object, STRING_SIZE(string->length), 0);
+		break;
+	}
+	}
+}
+
+#ifdef DEBUG_LOG_GC
+// Printing a rope would flatten it, which can't happen in the middle of a collection.
+static void logObject(Obj *object) {
+	if (object->type == OBJ_ROPE) {
+		printf("<rope>\n");
+	} else {
+		printValue(OBJ_VAL(object));
+		printf("\n");
+	}
+}
+#endif
+
+void markObject(Obj *object) {
+	// Young objects are left to minor collections, they can't reference old ones anyway.
+	if (object == NULL || IS_YOUNG(object) || object->isMarked)
+		return;
+#ifdef DEBUG_LOG_GC
+	printf("%p mark ", (void *)object);
+	logObject(object);
+#endif
+	object->isMarked = true;
+
+	// The gray stack is plain malloc memory, growing it through reallocate() could start
+	// another collection in the middle of this one.
+	if (vm.grayCapacity < vm.grayCount + 1) {
+		vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+		vm.grayStack = (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+		if (vm.grayStack == NULL)
+			exit(1);
+	}
+	vm.grayStack[vm.grayCount++] = object;
+}
+
+void markValue(Value value) {
+	if (IS_OBJ(value))
+		markObject(AS_OBJ(value));
+}
+
+static void markArray(ValueArray *array) {
+	for (int i = 0; i < array->count; i++) {
+		markValue(array->values[i]);
+	}
+}
+
+// Marks everything a gray object refers to, which turns it black.
+static void blackenObject(Obj *object) {
+#ifdef DEBUG_LOG_GC
+	printf("%p blacken ", (void *)object);
+	logObject(object);
+#endif
+	switch (object->type) {
+	case OBJ_FUNCTION: {
+		ObjFunction *function = (ObjFunction *)object;
+		markObject((Obj *)function->name);
+		// A shared constant pool is marked through the function that owns it.
+		if (function->chunk.constantsOwner != NULL) {
+			markObject(function->chunk.constantsOwner);
+		} else {
+			markArray(&function->chunk.constants);
+		}
+		// A cached callee is only compared by address, but if it were freed a new function could
+		// be allocated at the same address and pass the check, so the cache keeps it alive.
+		for (int i = 0; i < function->chunk.callCacheCount; i++) {
+			markObject(function->chunk.callCaches[i].callee);
+		}
+		break;
+	}
+	case OBJ_ROPE: {
+		ObjRope *rope = (ObjRope *)object;
+		markObject(rope->left);
+		markObject(rope->right);
+		markObject((Obj *)rope->flat);
+		break;
+	}
+	case OBJ_NATIVE:
+		markObject((Obj *)((ObjNative *)object)->name);
+		break;
+	case OBJ_STRING:
 		break;
 	}
+}
+
+static void markRoots() {
+	for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+		markValue(*slot);
+	}
+	for (int i = 0; i < vm.frameCount; i++) {
+		markObject((Obj *)vm.frames[i].function);
+	}
+	markTable(&vm.globals);
+	markArray(&vm.globalValues);
+	markArray(&vm.globalNames);
+	markCompilerRoots();
+	markBytecodeRoots();
+}
+
+static void traceReferences() {
+	while (vm.grayCount > 0) {
+		Obj *object = vm.grayStack[--vm.grayCount];
+		blackenObject(object);
+	}
+}
+
+static void sweep() {
+	Obj *previous = NULL;
+	Obj *object = vm.objects;
+	while (object != NULL) {
+		if (object->isMarked) {
+			object->isMarked = false;
+			previous = object;
+			object = object->next;
+		} else {
+			Obj *unreached = object;
+			object = object->next;
+			if (previous != NULL) {
+				previous->next = object;
+			} else {
+				vm.objects = object;
+			}
+			freeObject(unreached);
+		}
 	}
 }
 
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+	printf("-- gc begin\n");
+	size_t before = vm.bytesAllocated;
+#endif
+
+	markRoots();
+	traceReferences();
+	tableRemoveWhite(&vm.strings);
+	sweep();
+
+	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+#ifdef DEBUG_LOG_GC
+	printf("-- gc end\n");
+	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated,
+		   before, vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
 void freeObjects() {
 	// We need to go through the list of objects
 	// Get the head from the vm.
@@ -43,4 +338,5 @@ void freeObjects() {
 		freeObject(object);
 		object = next;
 	}
+	free(vm.grayStack);
 }
@@ -22,7 +22,40 @@
 #define FREE_ARRAY(type, pointer, oldCount)                                                        \
 	(type *)reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Overridden by the GC_HEAP_GROW_FACTOR CMake cache variable.
+#ifndef GC_HEAP_GROW_FACTOR
+#define GC_HEAP_GROW_FACTOR 2
+#endif
+
+// Overridden by the NURSERY_SIZE CMake cache variable.
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (256 * 1024)
+#endif
+
+// Young objects live in the nursery and nowhere else, so the address alone tells the generations
+// apart. Only used where vm.h is included.
+#define IS_YOUNG(object)                                                                           \
+	((uint8_t *)(object) >= vm.nurseryStart && (uint8_t *)(object) < vm.nurseryEnd)
+#define IS_YOUNG_VALUE(value) (IS_OBJ(value) && IS_YOUNG(AS_OBJ(value)))
+
+// Minor collections only scan the stack, so every other store of a young value into the heap has
+// to be recorded. Use it right before `array->values[index] = value`. A slot already holding a
+// young value is already remembered.
+#define WRITE_BARRIER(array, index, value)                                                         \
+	do {                                                                                           \
+		if (IS_YOUNG_VALUE(value) && !IS_YOUNG_VALUE((array)->values[index]))                      \
+			rememberSlot((array), (index));                                                        \
+	} while (false)
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void initNursery();
+void freeNursery();
+void *allocateYoung(size_t size);
+void rememberSlot(ValueArray *array, int index);
+void collectNursery();
+void markObject(Obj *object);
+void markValue(Value value);
+void collectGarbage();
 void freeObjects();
 
 #endif
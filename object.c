@@ -4,6 +4,7 @@
 #include "value.h"
 #include "vm.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define ALLOCATE_OBJ(type, objectType) (type *)allocateObject(sizeof(type), objectType)
@@ -14,6 +15,7 @@
 static Obj *allocateObject(size_t size, ObjType type) {
 	Obj *object = (Obj *)reallocate(NULL, 0, size);
 	object->type = type;
+	object->isMarked = false;
 
 	// Keep a link to the next object allocated.
 	// This tracks all objects to be freed later
@@ -25,23 +27,46 @@ static Obj *allocateObject(size_t size, ObjType type) {
 ObjFunction *newFunction() {
 	ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 	function->arity = 0;
+	function->maxStack = 0;
 	function->name = NULL;
 	initChunk(&function->chunk);
+	initChunk(&function->regChunk);
+	function->regCount = 0;
+	function->hotness = 0;
+	function->jit = NULL;
 	return function;
 }
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-	ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+ObjNative *newNative(NativeFn function, int arity, ObjString *name) {
+	ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+	native->function = function;
+	native->arity = arity;
+	native->name = name;
+	return native;
+}
+
+// One block holds the header and the characters, see ObjString in object.h.
+static ObjString *allocateString(int length) {
+	ObjString *string = (ObjString *)allocateObject(STRING_SIZE(length), OBJ_STRING);
 	string->length = length;
-	string->chars = chars;
-	string->hash = hash;
-	// Intern each string into a table of strings
-	// We have no Value, so its more like a set
-	tableSet(&vm.strings, string, NIL_VAL);
+	string->chars[length] = '\0';
+	string->hash = 0;
+	string->isInterned = false;
 	return string;
 }
 
-static uint32_t hashString(const char *key, int length) {
+// Intern each string into a table of strings
+// We have no Value, so its more like a set
+static void intern(ObjString *string) {
+	// Growing the table can collect, and nothing else refers to the new string yet.
+	stringHash(string);
+	string->isInterned = true;
+	push(OBJ_VAL(string));
+	tableSet(&vm.strings, string, NIL_VAL);
+	pop();
+}
+
+uint32_t hashString(const char *key, int length) {
 	// FNV-1a hash function
 	uint32_t hash = 2166136261u;
 	for (int i = 0; i < length; i++) {
@@ -52,17 +77,19 @@ static uint32_t hashString(const char *key, int length) {
 }
 
 ObjString *takeString(char *chars, int length) {
-	// Used for cases where the string is not re-allocated
-	// Instead its just inserted into ObjString->chars
+	// Used for cases where the caller built the characters in its own heap buffer.
+	// Ownership passes to this function, which frees the buffer once the characters are copied
+	// behind the header, or straight away if the string already exists in the interned table.
 	uint32_t hash = hashString(chars, length);
 	ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-	if (interned != NULL) {
-		// Sinced ownership is being passed to this function, we need to free the string
-		// if it already exists in the interned table. Then we just return that interned value.
-		FREE_ARRAY(char, chars, length + 1);
-		return interned;
+	if (interned == NULL) {
+		interned = allocateString(length);
+		memcpy(interned->chars, chars, length);
+		interned->hash = hash;
+		intern(interned);
 	}
-	return allocateString(chars, length, hash);
+	FREE_ARRAY(char, chars, length + 1);
+	return interned;
 }
 
 ObjString *copyString(const char *chars, int length) {
@@ -73,10 +100,117 @@ ObjString *copyString(const char *chars, int length) {
 	ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
 	if (interned != NULL)
 		return interned;
-	char *heapChars = ALLOCATE(char, length + 1);
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0';
-	return allocateString(heapChars, length, hash);
+	ObjString *string = allocateString(length);
+	memcpy(string->chars, chars, length);
+	string->hash = hash;
+	intern(string);
+	return string;
+}
+
+// Runtime strings start out in the nursery, so creating one is a pointer bump. The caller fills in
+// `length` characters. The string is neither hashed nor interned until something needs it to be.
+// Allocating can run a minor collection, which moves young objects.
+ObjString *allocateYoungString(int length) {
+	ObjString *string = (ObjString *)allocateYoung(STRING_SIZE(length));
+	if (string == NULL) {
+		// Too big for the nursery, it goes straight to the old space.
+		return allocateString(length);
+	}
+	string->obj.type = OBJ_STRING;
+	string->obj.isMarked = false;
+	string->obj.next = NULL;
+	string->length = length;
+	string->chars[length] = '\0';
+	string->hash = 0;
+	string->isInterned = false;
+	return string;
+}
+
+// A hash of 0 just means it's recomputed every time, which only costs time.
+uint32_t stringHash(ObjString *string) {
+	if (string->hash == 0)
+		string->hash = hashString(string->chars, string->length);
+	return string->hash;
+}
+
+// Copies a young string that survived a minor collection into the old space.
+ObjString *promoteString(ObjString *young) {
+	ObjString *string = allocateString(young->length);
+	memcpy(string->chars, young->chars, young->length);
+	string->hash = young->hash;
+	string->isInterned = young->isInterned;
+	return string;
+}
+
+// Ropes outlive the nursery's short-lived strings, so a young half is copied into the old space
+// instead of being referenced from there. The copy is only ever read through the rope, so it
+// doesn't need to be interned.
+static Obj *ropeHalf(Value value) {
+	if (!IS_STRING(value) || !IS_YOUNG(AS_OBJ(value)))
+		return AS_OBJ(value);
+	ObjString *copy = promoteString(AS_STRING(value));
+	copy->isInterned = false;
+	return (Obj *)copy;
+}
+
+// Both halves must be reachable from the stack, allocating the rope can collect.
+ObjRope *newRope(Value left, Value right) {
+	ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+	rope->length = stringLength(left) + stringLength(right);
+	rope->left = NULL;
+	rope->right = NULL;
+	rope->flat = NULL;
+	push(OBJ_VAL(rope));
+	rope->left = ropeHalf(left);
+	rope->right = ropeHalf(right);
+	pop();
+	return rope;
+}
+
+// Returns a string holding the rope's characters. Like any runtime string it isn't interned until
+// it has to be. The rope must be reachable from the stack, flattening allocates.
+ObjString *flattenRope(ObjRope *rope) {
+	if (rope->flat != NULL)
+		return rope->flat;
+
+	ObjString *string = allocateString(rope->length);
+	// Walk the tree right to left, filling the buffer from its end. Ropes built up in a loop lean
+	// to the left, which keeps this stack shallow for them. It is plain malloc memory so that
+	// growing it can't collect the string being filled.
+	int capacity = 8;
+	int count = 0;
+	Obj **stack = (Obj **)malloc(sizeof(Obj *) * capacity);
+	if (stack == NULL)
+		exit(1);
+	stack[count++] = (Obj *)rope;
+	int end = rope->length;
+	while (count > 0) {
+		Obj *node = stack[--count];
+		if (node->type == OBJ_ROPE) {
+			ObjRope *inner = (ObjRope *)node;
+			if (inner->flat == NULL) {
+				if (capacity < count + 2) {
+					capacity *= 2;
+					stack = (Obj **)realloc(stack, sizeof(Obj *) * capacity);
+					if (stack == NULL)
+						exit(1);
+				}
+				stack[count++] = inner->left;
+				stack[count++] = inner->right;
+				continue;
+			}
+			node = (Obj *)inner->flat;
+		}
+		ObjString *piece = (ObjString *)node;
+		end -= piece->length;
+		memcpy(string->chars + end, piece->chars, piece->length);
+	}
+	free(stack);
+
+	rope->flat = string;
+	rope->left = NULL;
+	rope->right = NULL;
+	return string;
 }
 
 static int printFunction(ObjFunction *function) {
@@ -94,6 +228,10 @@ int printObject(Value value) {
 		return printFunction(AS_FUNCTION(value));
 	case OBJ_STRING:
 		return printf("%s", AS_CSTRING(value));
+	case OBJ_ROPE:
+		return printf("%s", flattenRope(AS_ROPE(value))->chars);
+	case OBJ_NATIVE:
+		return printf("<native fn %s>", AS_NATIVE(value)->name->chars);
 	}
 	return 0;
 }
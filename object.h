@@ -11,18 +11,28 @@
 // And has the type that's passed in i.e. string
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+// Either representation of a string value, see ObjRope.
+#define IS_STRING_LIKE(value) (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 
 typedef enum {
 	OBJ_STRING,
 	OBJ_FUNCTION,
+	OBJ_ROPE,
+	OBJ_NATIVE,
 } ObjType;
 
 struct Obj {
 	ObjType type;
+	// Set while a collection finds the object reachable, cleared again by the sweep.
+	bool isMarked;
 	// pointer to next Obj in the chain used for garbage collector.
 	// Introduced in https://craftinginterpreters.com/strings.html#freeing-objects
 	struct Obj *next;
@@ -31,22 +41,74 @@ struct Obj {
 typedef struct {
 	Obj obj;
 	int arity;
+	// Deepest the value stack gets in a call of this function, counted from the callee's slot.
+	int maxStack;
 	Chunk chunk;
 	ObjString *name;
+	// Register backend translation of chunk, empty until compileRegisters() runs.
+	// Its constants live in chunk.constants, regCount is the size of the frame's register window.
+	Chunk regChunk;
+	int regCount;
+	// Calls plus loop back edges run by the interpreter, and the machine code compiled once that
+	// passes JIT_THRESHOLD. See jit.h, jit stays NULL in builds without the JIT.
+	int hotness;
+	struct JitCode *jit;
 } ObjFunction;
 
 struct ObjString {
 	// This is an enum of the types, that uses structural inheritance from the Obj above
 	Obj obj;
 	int length;
-	char *chars;
+	// Computed on first use for runtime strings, see stringHash().
 	uint32_t hash;
+	// Whether this is the canonical copy in vm.strings. Strings made by copyString() and
+	// takeString() are interned as they are created, runtime ones never are.
+	bool isInterned;
+	// The characters follow the header in the same allocation, NUL terminated.
+	char chars[];
 };
 
+// Bytes taken by a string of `length` characters, header included.
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+// Concatenations at least this long build a rope instead of copying their operands.
+#define ROPE_MIN_LENGTH 64
+
+// A string value built by `+` whose characters haven't been needed yet. It just records its two
+// halves, each a string or another rope. flattenRope() copies the characters out once, interns
+// them and keeps the result in `flat`, after which the halves are dropped.
+typedef struct {
+	Obj obj;
+	int length;
+	Obj *left;
+	Obj *right;
+	ObjString *flat;
+} ObjRope;
+
+// A function implemented in C. It reads its arguments straight off the caller's stack and returns
+// the result, the VM pushes no frame for it.
+typedef Value (*NativeFn)(int argCount, Value *args);
+
+typedef struct {
+	Obj obj;
+	NativeFn function;
+	// Checked by the VM before the call, so natives can index args without checking.
+	int arity;
+	ObjString *name;
+} ObjNative;
+
 ObjFunction *newFunction();
+ObjNative *newNative(NativeFn function, int arity, ObjString *name);
 
 ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
+ObjString *allocateYoungString(int length);
+uint32_t stringHash(ObjString *string);
+// FNV-1a hash of length characters, the hash strings are interned by.
+uint32_t hashString(const char *key, int length);
+ObjString *promoteString(ObjString *string);
+ObjRope *newRope(Value left, Value right);
+ObjString *flattenRope(ObjRope *rope);
 
 int printObject(Value value);
 static inline bool isObjType(Value value, ObjType type) {
@@ -54,4 +116,9 @@ static inline bool isObjType(Value value, ObjType type) {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// Length of a string or rope value.
+static inline int stringLength(Value value) {
+	return IS_ROPE(value) ? AS_ROPE(value)->length : AS_STRING(value)->length;
+}
+
 #endif
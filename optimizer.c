@@ -0,0 +1,194 @@
+#include "optimizer.h"
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// A jump whose operand has to be recomputed once every instruction has its new offset.
+typedef struct {
+	int from;	// Offset of the jump instruction in the new code.
+	int target; // Offset the jump lands on in the old code.
+} PendingJump;
+
+typedef struct {
+	Chunk *chunk;
+	// Per old offset: is it the first byte of an instruction, does any jump land on it.
+	bool *isStart;
+	bool *isTarget;
+	// Old instruction offset -> new instruction offset.
+	int *newOffset;
+	uint8_t *code;
+	int *lines;
+	int count;
+	PendingJump *jumps;
+	int jumpCount;
+} Optimizer;
+
+static int jumpTarget(Chunk *chunk, int offset) {
+	uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+	if (chunk->code[offset] == OP_LOOP)
+		return offset + 3 - jump;
+	return offset + 3 + jump;
+}
+
+static void emit(Optimizer *opt, uint8_t byte, int line) {
+	opt->code[opt->count] = byte;
+	opt->lines[opt->count] = line;
+	opt->count++;
+}
+
+static void emitJumpTo(Optimizer *opt, uint8_t instruction, int target, int line) {
+	opt->jumps[opt->jumpCount].from = opt->count;
+	opt->jumps[opt->jumpCount].target = target;
+	opt->jumpCount++;
+	emit(opt, instruction, line);
+	// Placeholder operand, patched once all new offsets are known.
+	emit(opt, 0xff, line);
+	emit(opt, 0xff, line);
+}
+
+// True when the `n` instructions starting at `offset` can be fused: each one exists and no jump
+// lands in the middle of the sequence.
+static bool fusable(Optimizer *opt, int offset, int n, int *next) {
+	Chunk *chunk = opt->chunk;
+	for (int i = 0; i < n; i++) {
+		if (offset >= chunk->count)
+			return false;
+		if (i > 0 && opt->isTarget[offset])
+			return false;
+		next[i] = offset;
+		offset += instructionLength(chunk->code[offset]);
+	}
+	return true;
+}
+
+// Tries to replace the sequence starting at `offset` with a superinstruction.
+// Returns the old offset just past the fused sequence, or -1 if nothing matched.
+static int fuse(Optimizer *opt, int offset) {
+	Chunk *chunk = opt->chunk;
+	uint8_t *code = chunk->code;
+	int at[3];
+
+	// OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD -> OP_ADD_LOCALS a b
+	if (fusable(opt, offset, 3, at) && code[at[0]] == OP_GET_LOCAL &&
+		code[at[1]] == OP_GET_LOCAL && code[at[2]] == OP_ADD) {
+		int line = getLine(chunk, at[2]);
+		emit(opt, OP_ADD_LOCALS, line);
+		emit(opt, code[at[0] + 1], line);
+		emit(opt, code[at[1] + 1], line);
+		return at[2] + 1;
+	}
+
+	// OP_LESS, OP_JUMP_IF_FALSE, OP_POP -> OP_LESS_JUMP_IF_FALSE
+	// The condition is never pushed, so the jump has to skip the OP_POP that cleans it up on the
+	// false branch. Every jump the compiler emits for if/while/for lands on exactly that OP_POP.
+	if (fusable(opt, offset, 3, at) && code[at[0]] == OP_LESS && code[at[1]] == OP_JUMP_IF_FALSE &&
+		code[at[2]] == OP_POP) {
+		int target = jumpTarget(chunk, at[1]);
+		if (target < chunk->count && opt->isStart[target] && code[target] == OP_POP &&
+			target + 1 <= chunk->count) {
+			emitJumpTo(opt, OP_LESS_JUMP_IF_FALSE, target + 1, getLine(chunk, at[0]));
+			return at[2] + 1;
+		}
+	}
+
+	// OP_CONSTANT k, OP_ADD -> OP_ADD_CONSTANT k
+	if (fusable(opt, offset, 2, at) && code[at[0]] == OP_CONSTANT && code[at[1]] == OP_ADD) {
+		int line = getLine(chunk, at[1]);
+		emit(opt, OP_ADD_CONSTANT, line);
+		emit(opt, code[at[0] + 1], line);
+		return at[1] + 1;
+	}
+
+	// OP_SET_LOCAL s, OP_POP -> OP_SET_LOCAL_POP s
+	if (fusable(opt, offset, 2, at) && code[at[0]] == OP_SET_LOCAL && code[at[1]] == OP_POP) {
+		int line = getLine(chunk, at[0]);
+		emit(opt, OP_SET_LOCAL_POP, line);
+		emit(opt, code[at[0] + 1], line);
+		return at[1] + 1;
+	}
+
+	return -1;
+}
+
+void optimizeChunk(Chunk *chunk) {
+	int count = chunk->count;
+	if (count == 0)
+		return;
+
+	Optimizer opt;
+	opt.chunk = chunk;
+	// One extra slot so a jump to the very end of the chunk has somewhere to map to.
+	opt.isStart = ALLOCATE(bool, count + 1);
+	opt.isTarget = ALLOCATE(bool, count + 1);
+	opt.newOffset = ALLOCATE(int, count + 1);
+	memset(opt.isStart, 0, sizeof(bool) * (count + 1));
+	memset(opt.isTarget, 0, sizeof(bool) * (count + 1));
+	// Fused code is never longer than the original.
+	opt.code = ALLOCATE(uint8_t, count);
+	opt.lines = ALLOCATE(int, count);
+	opt.count = 0;
+	opt.jumps = ALLOCATE(PendingJump, count);
+	opt.jumpCount = 0;
+
+	// First pass: find instruction boundaries and every offset a jump lands on.
+	for (int offset = 0; offset < count; offset += instructionLength(chunk->code[offset])) {
+		opt.isStart[offset] = true;
+		uint8_t instruction = chunk->code[offset];
+		if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP) {
+			int target = jumpTarget(chunk, offset);
+			if (target >= 0 && target <= count)
+				opt.isTarget[target] = true;
+		}
+	}
+	opt.isStart[count] = true;
+
+	// Second pass: copy instructions across, fusing wherever a pattern matches.
+	int offset = 0;
+	while (offset < count) {
+		opt.newOffset[offset] = opt.count;
+		int next = fuse(&opt, offset);
+		if (next != -1) {
+			offset = next;
+			continue;
+		}
+		uint8_t instruction = chunk->code[offset];
+		int length = instructionLength(instruction);
+		int line = getLine(chunk, offset);
+		if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP) {
+			emitJumpTo(&opt, instruction, jumpTarget(chunk, offset), line);
+		} else {
+			for (int i = 0; i < length; i++) {
+				emit(&opt, chunk->code[offset + i], line);
+			}
+		}
+		offset += length;
+	}
+	opt.newOffset[count] = opt.count;
+
+	// Third pass: now that every instruction has moved, point the jumps at their new targets.
+	for (int i = 0; i < opt.jumpCount; i++) {
+		int from = opt.jumps[i].from;
+		int to = opt.newOffset[opt.jumps[i].target];
+		int jump = opt.code[from] == OP_LOOP ? from + 3 - to : to - (from + 3);
+		opt.code[from + 1] = (jump >> 8) & 0xff;
+		opt.code[from + 2] = jump & 0xff;
+	}
+
+	// The fused code always fits in the chunk's own code array, which may belong to the compiler's
+	// arena, so write it back instead of swapping buffers. That also re-encodes the line runs.
+	chunk->count = 0;
+	chunk->lineCount = 0;
+	for (int i = 0; i < opt.count; i++) {
+		writeChunk(chunk, opt.code[i], opt.lines[i]);
+	}
+
+	FREE_ARRAY(bool, opt.isStart, count + 1);
+	FREE_ARRAY(bool, opt.isTarget, count + 1);
+	FREE_ARRAY(int, opt.newOffset, count + 1);
+	FREE_ARRAY(PendingJump, opt.jumps, count);
+	FREE_ARRAY(uint8_t, opt.code, count);
+	FREE_ARRAY(int, opt.lines, count);
+}
@@ -0,0 +1,10 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// Rewrites a finished chunk in place, fusing common instruction sequences into
+// superinstructions. Jump offsets and the lines array are rebuilt to match the new code.
+void optimizeChunk(Chunk *chunk);
+
+#endif
@@ -0,0 +1,106 @@
+#include "profile.h"
+
+#ifdef PROFILE_OPCODES
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+Profile profile;
+
+// Ticks between two back-to-back readings. Every instruction's figure includes about this much of
+// the profiler's own overhead.
+static uint64_t timerOverhead;
+
+// How many of the most frequent opcode pairs to print.
+#define PROFILE_TOP_PAIRS 30
+
+typedef struct {
+	uint16_t pair; // First opcode in the high byte, second in the low.
+	uint64_t count;
+} PairCount;
+
+static int compareOpcodes(const void *a, const void *b) {
+	uint64_t left = profile.counts[*(const uint8_t *)a];
+	uint64_t right = profile.counts[*(const uint8_t *)b];
+	return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static int comparePairs(const void *a, const void *b) {
+	uint64_t left = ((const PairCount *)a)->count;
+	uint64_t right = ((const PairCount *)b)->count;
+	return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static void printProfile() {
+	uint64_t instructions = 0;
+	uint64_t ticks = 0;
+	uint8_t opcodes[UINT8_COUNT];
+	int opcodeCount = 0;
+	for (int i = 0; i < UINT8_COUNT; i++) {
+		if (profile.counts[i] == 0)
+			continue;
+		instructions += profile.counts[i];
+		ticks += profile.ticks[i];
+		opcodes[opcodeCount++] = (uint8_t)i;
+	}
+	if (instructions == 0)
+		return;
+	qsort(opcodes, opcodeCount, sizeof(uint8_t), compareOpcodes);
+
+	fprintf(stderr,
+			"== opcode profile: %llu instructions, %llu ticks, ~%llu ticks overhead each ==\n",
+			(unsigned long long)instructions, (unsigned long long)ticks,
+			(unsigned long long)timerOverhead);
+	fprintf(stderr, "%4s %-22s %14s %7s %16s %7s %9s\n", "RANK", "OPCODE", "COUNT", "%", "TICKS",
+			"%", "TICKS/OP");
+	for (int i = 0; i < opcodeCount; i++) {
+		uint8_t op = opcodes[i];
+		fprintf(stderr, "%4d %-22s %14llu %6.2f%% %16llu %6.2f%% %9.1f\n", i + 1, opcodeName(op),
+				(unsigned long long)profile.counts[op], 100.0 * profile.counts[op] / instructions,
+				(unsigned long long)profile.ticks[op],
+				ticks ? 100.0 * profile.ticks[op] / ticks : 0.0,
+				(double)profile.ticks[op] / profile.counts[op]);
+	}
+
+	// Only pairs that actually ran, there are usually a few dozen out of the 65536 possible.
+	int pairCount = 0;
+	PairCount *pairs = malloc(sizeof(PairCount) * UINT8_COUNT * UINT8_COUNT);
+	if (pairs == NULL)
+		return;
+	uint64_t pairTotal = 0;
+	for (int first = 0; first < UINT8_COUNT; first++) {
+		for (int second = 0; second < UINT8_COUNT; second++) {
+			uint64_t count = profile.pairs[first][second];
+			if (count == 0)
+				continue;
+			pairs[pairCount].pair = (uint16_t)(first << 8 | second);
+			pairs[pairCount].count = count;
+			pairCount++;
+			pairTotal += count;
+		}
+	}
+	qsort(pairs, pairCount, sizeof(PairCount), comparePairs);
+
+	fprintf(stderr, "\n== top opcode pairs: %d distinct ==\n", pairCount);
+	fprintf(stderr, "%4s %-22s %-22s %14s %7s\n", "RANK", "FIRST", "SECOND", "COUNT", "%");
+	for (int i = 0; i < pairCount && i < PROFILE_TOP_PAIRS; i++) {
+		fprintf(stderr, "%4d %-22s %-22s %14llu %6.2f%%\n", i + 1, opcodeName(pairs[i].pair >> 8),
+				opcodeName(pairs[i].pair & 0xff), (unsigned long long)pairs[i].count,
+				100.0 * pairs[i].count / pairTotal);
+	}
+	free(pairs);
+}
+
+void initProfile() {
+	profile.previous = -1;
+	uint64_t best = UINT64_MAX;
+	for (int i = 0; i < 1000; i++) {
+		uint64_t start = readTicks();
+		uint64_t end = readTicks();
+		if (end - start < best)
+			best = end - start;
+	}
+	timerOverhead = best;
+	atexit(printProfile);
+}
+#endif
@@ -0,0 +1,56 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "common.h"
+
+#ifdef PROFILE_OPCODES
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Execution counts of every opcode and every pair of consecutive opcodes, and the ticks spent in
+// each opcode. An instruction's ticks run from its dispatch to the next one, so they include the
+// dispatch itself and whatever the handler called into (natives, the collector).
+typedef struct {
+	uint64_t counts[UINT8_COUNT];
+	uint64_t pairs[UINT8_COUNT][UINT8_COUNT];
+	uint64_t ticks[UINT8_COUNT];
+	int previous; // Opcode dispatched last, -1 at the start of run().
+	uint64_t lastTick;
+} Profile;
+
+extern Profile profile;
+
+// Cycles from the time-stamp counter on x86, nanoseconds elsewhere.
+static inline uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Called on every dispatch, so it is kept to a few adds.
+static inline void profileInstruction(uint8_t instruction) {
+	uint64_t now = readTicks();
+	if (profile.previous >= 0) {
+		profile.ticks[profile.previous] += now - profile.lastTick;
+		profile.pairs[profile.previous][instruction]++;
+	}
+	profile.counts[instruction]++;
+	profile.previous = instruction;
+	profile.lastTick = now;
+}
+
+// run() calls this on entry so time spent outside the loop, e.g. the REPL reading the next line,
+// isn't charged to the last instruction of the previous run.
+static inline void profileStart() { profile.previous = -1; }
+
+// Measures the profiler's own cost and prints the ranked tables to stderr when the process exits.
+void initProfile();
+#endif
+
+#endif
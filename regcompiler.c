@@ -0,0 +1,499 @@
+#include "regcompiler.h"
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+// The register code is generated from the finished stack bytecode rather than from source.
+// The depth of the value stack is known statically at every instruction, so each stack position
+// becomes a register: position p of the frame is register p. Locals already live at fixed
+// positions, which makes them registers for free.
+//
+// To avoid copying a local to the top of the stack just to read it, a position can be "lazy":
+// it records the register that already holds its value. A lazy position is materialized with a
+// ROP_MOVE only when its own register must hold the value, i.e. before the source register is
+// overwritten, before control flow merges and before a call needs its arguments in a row.
+
+// A jump whose offset is patched once the label it targets has been emitted.
+typedef struct {
+	int from;	// Offset of the ROP_JUMP/ROP_JUMP_IF_FALSE in the register chunk.
+	int target; // Offset of the target in the stack chunk.
+} PendingJump;
+
+typedef struct {
+	ObjFunction *function;
+	Chunk *in;
+	Chunk *out;
+	// Register currently holding the value of each stack position. Equal to the position itself
+	// once materialized.
+	uint8_t stack[UINT8_COUNT];
+	int depth;
+	int maxDepth;
+	// Indexed by stack chunk offset.
+	bool *isTarget;
+	int *labels;
+	int *depthAt;
+	PendingJump *jumps;
+	int jumpCount;
+	// Register chunk offsets of the last instruction and the last label, for retargeting.
+	int lastInstruction;
+	int lastLabel;
+	int line;
+	bool failed;
+} RegCompiler;
+
+static void fail(RegCompiler *rc) { rc->failed = true; }
+
+static void emit(RegCompiler *rc, uint8_t op, uint8_t a, uint8_t b, uint8_t c) {
+	rc->lastInstruction = rc->out->count;
+	writeChunk(rc->out, op, rc->line);
+	writeChunk(rc->out, a, rc->line);
+	writeChunk(rc->out, b, rc->line);
+	writeChunk(rc->out, c, rc->line);
+}
+
+static void push(RegCompiler *rc, int reg) {
+	if (rc->depth >= UINT8_COUNT) {
+		fail(rc);
+		return;
+	}
+	rc->stack[rc->depth++] = (uint8_t)reg;
+	if (rc->depth > rc->maxDepth)
+		rc->maxDepth = rc->depth;
+}
+
+// Returns the register holding the value popped off the top.
+static uint8_t pop(RegCompiler *rc) {
+	if (rc->depth == 0) {
+		fail(rc);
+		return 0;
+	}
+	return rc->stack[--rc->depth];
+}
+
+static uint8_t top(RegCompiler *rc) { return rc->depth == 0 ? 0 : rc->stack[rc->depth - 1]; }
+
+static void materialize(RegCompiler *rc, int position) {
+	if (rc->stack[position] != position) {
+		emit(rc, ROP_MOVE, position, rc->stack[position], 0);
+		rc->stack[position] = position;
+	}
+}
+
+static void materializeAll(RegCompiler *rc) {
+	for (int i = 0; i < rc->depth; i++) {
+		materialize(rc, i);
+	}
+}
+
+static bool isReferenced(RegCompiler *rc, int reg, int below) {
+	for (int i = 0; i < below; i++) {
+		if (i != reg && rc->stack[i] == reg)
+			return true;
+	}
+	return false;
+}
+
+// Called before `reg` is overwritten, so nothing still reads the old value through it.
+static void spill(RegCompiler *rc, int reg) {
+	for (int i = 0; i < rc->depth; i++) {
+		if (i != reg && rc->stack[i] == reg)
+			materialize(rc, i);
+	}
+}
+
+static void emitJumpTo(RegCompiler *rc, uint8_t op, uint8_t a, int target) {
+	if (target < 0 || target > rc->in->count) {
+		fail(rc);
+		return;
+	}
+	if (rc->depthAt[target] != rc->depth) {
+		fail(rc);
+		return;
+	}
+	rc->jumps[rc->jumpCount].from = rc->out->count;
+	rc->jumps[rc->jumpCount].target = target;
+	rc->jumpCount++;
+	emit(rc, op, a, 0xff, 0xff);
+}
+
+// Stores the value on top of the stack into local `slot`. When the top is a temporary that was
+// just computed, the instruction that computed it is retargeted to write the local directly.
+static void setLocal(RegCompiler *rc, int slot) {
+	int position = rc->depth - 1;
+	uint8_t source = top(rc);
+	if (slot >= position) {
+		fail(rc);
+		return;
+	}
+	if (source == slot)
+		return;
+	if (source == position && !isReferenced(rc, slot, rc->depth) &&
+		rc->lastInstruction >= rc->lastLabel && rc->lastInstruction >= 0 &&
+		rc->out->code[rc->lastInstruction + 1] == position) {
+		uint8_t op = rc->out->code[rc->lastInstruction];
+		if (op != ROP_CALL && op != ROP_TAIL_CALL && op != ROP_PRINT && op != ROP_JUMP &&
+			op != ROP_JUMP_IF_FALSE && op != ROP_LESS_JUMP && op != ROP_RETURN &&
+			op != ROP_DEFINE_GLOBAL && op != ROP_SET_GLOBAL) {
+			rc->out->code[rc->lastInstruction + 1] = slot;
+			rc->stack[position] = slot;
+			rc->stack[slot] = slot;
+			return;
+		}
+	}
+	spill(rc, slot);
+	emit(rc, ROP_MOVE, slot, source, 0);
+	// The local's own register now holds its value, even if it used to alias another local.
+	rc->stack[slot] = slot;
+}
+
+static void binary(RegCompiler *rc, uint8_t op) {
+	uint8_t b = pop(rc);
+	uint8_t a = pop(rc);
+	int dest = rc->depth;
+	emit(rc, op, dest, a, b);
+	push(rc, dest);
+}
+
+static void unary(RegCompiler *rc, uint8_t op) {
+	uint8_t a = pop(rc);
+	int dest = rc->depth;
+	emit(rc, op, dest, a, 0);
+	push(rc, dest);
+}
+
+static void load(RegCompiler *rc, uint8_t op, uint8_t b) {
+	int dest = rc->depth;
+	emit(rc, op, dest, b, 0);
+	push(rc, dest);
+}
+
+static int jumpTarget(Chunk *chunk, int offset) {
+	uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+	if (chunk->code[offset] == OP_LOOP)
+		return offset + 3 - jump;
+	return offset + 3 + jump;
+}
+
+// Translates one stack instruction. Returns false after an unconditional transfer of control.
+static bool translate(RegCompiler *rc, int offset) {
+	uint8_t *code = rc->in->code;
+	uint8_t instruction = genericOpcode(code[offset]);
+	switch (instruction) {
+	case OP_CONSTANT:
+		load(rc, ROP_LOADK, code[offset + 1]);
+		return true;
+	case OP_NIL:
+		load(rc, ROP_LOADNIL, 0);
+		return true;
+	case OP_TRUE:
+		load(rc, ROP_LOADTRUE, 0);
+		return true;
+	case OP_FALSE:
+		load(rc, ROP_LOADFALSE, 0);
+		return true;
+	case OP_POP:
+		pop(rc);
+		return true;
+	case OP_GET_LOCAL: {
+		uint8_t slot = code[offset + 1];
+		if (slot >= rc->depth) {
+			fail(rc);
+			return true;
+		}
+		// No code at all, the new position just reads the local's register.
+		push(rc, rc->stack[slot]);
+		return true;
+	}
+	case OP_SET_LOCAL:
+		setLocal(rc, code[offset + 1]);
+		return true;
+	case OP_SET_LOCAL_POP:
+		setLocal(rc, code[offset + 1]);
+		pop(rc);
+		return true;
+	case OP_GET_GLOBAL: {
+		int dest = rc->depth;
+		emit(rc, ROP_GET_GLOBAL, dest, code[offset + 1], code[offset + 2]);
+		push(rc, dest);
+		return true;
+	}
+	case OP_DEFINE_GLOBAL:
+		emit(rc, ROP_DEFINE_GLOBAL, pop(rc), code[offset + 1], code[offset + 2]);
+		return true;
+	case OP_SET_GLOBAL:
+		emit(rc, ROP_SET_GLOBAL, top(rc), code[offset + 1], code[offset + 2]);
+		return true;
+	case OP_EQUAL:
+		binary(rc, ROP_EQUAL);
+		return true;
+	case OP_GREATER:
+		binary(rc, ROP_GREATER);
+		return true;
+	case OP_LESS:
+		binary(rc, ROP_LESS);
+		return true;
+	case OP_ADD:
+		binary(rc, ROP_ADD);
+		return true;
+	case OP_SUBTRACT:
+		binary(rc, ROP_SUBTRACT);
+		return true;
+	case OP_MULTIPLY:
+		binary(rc, ROP_MULTIPLY);
+		return true;
+	case OP_DIVIDE:
+		binary(rc, ROP_DIVIDE);
+		return true;
+	case OP_NOT:
+		unary(rc, ROP_NOT);
+		return true;
+	case OP_NEGATE:
+		unary(rc, ROP_NEGATE);
+		return true;
+	case OP_PRINT:
+		emit(rc, ROP_PRINT, pop(rc), 0, 0);
+		return true;
+	case OP_ADD_LOCALS: {
+		uint8_t a = code[offset + 1];
+		uint8_t b = code[offset + 2];
+		if (a >= rc->depth || b >= rc->depth) {
+			fail(rc);
+			return true;
+		}
+		int dest = rc->depth;
+		emit(rc, ROP_ADD, dest, rc->stack[a], rc->stack[b]);
+		push(rc, dest);
+		return true;
+	}
+	case OP_ADD_CONSTANT: {
+		uint8_t a = pop(rc);
+		int dest = rc->depth;
+		emit(rc, ROP_ADD_CONSTANT, dest, a, code[offset + 1]);
+		push(rc, dest);
+		return true;
+	}
+	case OP_JUMP:
+		materializeAll(rc);
+		emitJumpTo(rc, ROP_JUMP, 0, jumpTarget(rc->in, offset));
+		return false;
+	case OP_JUMP_IF_FALSE:
+		materializeAll(rc);
+		emitJumpTo(rc, ROP_JUMP_IF_FALSE, rc->depth - 1, jumpTarget(rc->in, offset));
+		return true;
+	case OP_LESS_JUMP_IF_FALSE: {
+		uint8_t b = pop(rc);
+		uint8_t a = pop(rc);
+		materializeAll(rc);
+		emit(rc, ROP_LESS_JUMP, a, b, 0);
+		emitJumpTo(rc, ROP_JUMP, 0, jumpTarget(rc->in, offset));
+		return true;
+	}
+	case OP_LOOP: {
+		materializeAll(rc);
+		int target = jumpTarget(rc->in, offset);
+		if (target < 0 || rc->labels[target] == -1) {
+			fail(rc);
+			return false;
+		}
+		int jump = rc->labels[target] - (rc->out->count + REG_INSTRUCTION_SIZE);
+		if (jump < INT16_MIN) {
+			fail(rc);
+			return false;
+		}
+		emit(rc, ROP_JUMP, 0, (uint8_t)((jump >> 8) & 0xff), (uint8_t)(jump & 0xff));
+		return false;
+	}
+	case OP_CALL:
+	case OP_TAIL_CALL: {
+		int argCount = code[offset + 1];
+		int base = rc->depth - argCount - 1;
+		if (base < 0) {
+			fail(rc);
+			return true;
+		}
+		// The callee's frame starts at the callee register, so it and the arguments have to
+		// be laid out exactly as the stack backend would have them.
+		for (int i = base; i < rc->depth; i++) {
+			materialize(rc, i);
+		}
+		emit(rc, code[offset] == OP_TAIL_CALL ? ROP_TAIL_CALL : ROP_CALL, base, argCount, 0);
+		rc->depth = base;
+		push(rc, base);
+		return true;
+	}
+	case OP_RETURN:
+		emit(rc, ROP_RETURN, top(rc), 0, 0);
+		return false;
+	default:
+		// An instruction this backend doesn't know about yet.
+		fail(rc);
+		return false;
+	}
+}
+
+// Finds the stack depth before every reachable instruction by following both edges of each jump.
+// Labels only reached by a backward jump, like a for loop's increment clause, need this since the
+// linear translation reaches them before the jump that enters them.
+static void computeDepths(RegCompiler *rc) {
+	Chunk *in = rc->in;
+	int *worklist = ALLOCATE(int, in->count + 1);
+	int pending = 0;
+	rc->depthAt[0] = rc->function->arity + 1;
+	worklist[pending++] = 0;
+	while (pending > 0 && !rc->failed) {
+		int offset = worklist[--pending];
+		uint8_t instruction = in->code[offset];
+		int depth = rc->depthAt[offset] + instructionStackEffect(in, offset);
+		int successors[2];
+		int successorCount = 0;
+		if (instruction == OP_JUMP || instruction == OP_LOOP) {
+			successors[successorCount++] = jumpTarget(in, offset);
+		} else if (instruction == OP_JUMP_IF_FALSE || instruction == OP_LESS_JUMP_IF_FALSE) {
+			successors[successorCount++] = jumpTarget(in, offset);
+			successors[successorCount++] = offset + instructionLength(instruction);
+		} else if (instruction != OP_RETURN) {
+			successors[successorCount++] = offset + instructionLength(instruction);
+		}
+		for (int i = 0; i < successorCount; i++) {
+			int next = successors[i];
+			if (next < 0 || next >= in->count || depth < 0 || depth >= UINT8_COUNT) {
+				fail(rc);
+			} else if (rc->depthAt[next] == -1) {
+				rc->depthAt[next] = depth;
+				worklist[pending++] = next;
+			} else if (rc->depthAt[next] != depth) {
+				fail(rc);
+			}
+		}
+	}
+	FREE_ARRAY(int, worklist, in->count + 1);
+}
+
+static bool compileFunction(ObjFunction *function) {
+	Chunk *in = &function->chunk;
+	int count = in->count;
+
+	RegCompiler rc;
+	rc.function = function;
+	rc.in = in;
+	rc.out = &function->regChunk;
+	rc.depth = 0;
+	rc.maxDepth = 0;
+	rc.isTarget = ALLOCATE(bool, count + 1);
+	rc.labels = ALLOCATE(int, count + 1);
+	rc.depthAt = ALLOCATE(int, count + 1);
+	rc.jumps = ALLOCATE(PendingJump, count + 1);
+	rc.jumpCount = 0;
+	rc.lastInstruction = -1;
+	rc.lastLabel = 0;
+	rc.line = 0;
+	rc.failed = false;
+	memset(rc.isTarget, 0, sizeof(bool) * (count + 1));
+	for (int i = 0; i <= count; i++) {
+		rc.labels[i] = -1;
+		rc.depthAt[i] = -1;
+	}
+
+	for (int offset = 0; offset < count; offset += instructionLength(in->code[offset])) {
+		uint8_t instruction = in->code[offset];
+		if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP ||
+			instruction == OP_LESS_JUMP_IF_FALSE) {
+			int target = jumpTarget(in, offset);
+			if (target >= 0 && target <= count)
+				rc.isTarget[target] = true;
+		}
+	}
+
+	computeDepths(&rc);
+
+	// The callee and its arguments are already in place when a frame starts.
+	for (int i = 0; i <= function->arity; i++) {
+		push(&rc, i);
+	}
+
+	bool reachable = true;
+	for (int offset = 0; offset < count && !rc.failed;
+		 offset += instructionLength(in->code[offset])) {
+		rc.line = getLine(in, offset);
+		if (rc.isTarget[offset]) {
+			if (reachable) {
+				materializeAll(&rc);
+			} else if (rc.depthAt[offset] != -1) {
+				// Only reached by jumps, which left every position materialized.
+				rc.depth = rc.depthAt[offset];
+				for (int i = 0; i < rc.depth; i++) {
+					rc.stack[i] = i;
+				}
+				reachable = true;
+			}
+			rc.labels[offset] = rc.out->count;
+			rc.lastLabel = rc.out->count;
+		}
+		// Code after an unconditional jump or return that no live jump lands on is dropped.
+		if (!reachable || rc.depthAt[offset] == -1) {
+			reachable = false;
+			continue;
+		}
+		if (rc.depth != rc.depthAt[offset]) {
+			fail(&rc);
+			break;
+		}
+		reachable = translate(&rc, offset);
+	}
+	rc.labels[count] = rc.out->count;
+
+	for (int i = 0; i < rc.jumpCount && !rc.failed; i++) {
+		int from = rc.jumps[i].from;
+		int to = rc.labels[rc.jumps[i].target];
+		int jump = to - (from + REG_INSTRUCTION_SIZE);
+		if (to == -1 || jump > INT16_MAX) {
+			fail(&rc);
+			break;
+		}
+		rc.out->code[from + 2] = (uint8_t)((jump >> 8) & 0xff);
+		rc.out->code[from + 3] = (uint8_t)(jump & 0xff);
+	}
+	function->regCount = rc.maxDepth + 1;
+
+	FREE_ARRAY(bool, rc.isTarget, count + 1);
+	FREE_ARRAY(int, rc.labels, count + 1);
+	FREE_ARRAY(int, rc.depthAt, count + 1);
+	FREE_ARRAY(PendingJump, rc.jumps, count + 1);
+
+	if (rc.failed) {
+		freeChunk(&function->regChunk);
+		return false;
+	}
+#ifdef DEBUG_PRINT_CODE
+	disassembleRegisterChunk(&function->regChunk,
+							 function->name != NULL ? function->name->chars : "<script>");
+#endif
+	return true;
+}
+
+bool compileRegisters(ObjFunction *function) {
+	// Functions from earlier REPL lines are already translated.
+	if (function->regChunk.count > 0)
+		return true;
+	if (!compileFunction(function))
+		return false;
+	// A shared constant pool is walked once, through the script that owns it.
+	if (function->chunk.constantsOwner != NULL)
+		return true;
+	ValueArray *constants = &function->chunk.constants;
+	for (int i = 0; i < constants->count; i++) {
+		if (IS_FUNCTION(constants->values[i]) &&
+			!compileRegisters(AS_FUNCTION(constants->values[i]))) {
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,11 @@
+#ifndef clox_regcompiler_h
+#define clox_regcompiler_h
+
+#include "object.h"
+
+// Generates register bytecode into function->regChunk for the function and every function nested
+// in its constants. Returns false if some function can't be expressed in registers, in which case
+// the stack backend has to run the program.
+bool compileRegisters(ObjFunction *function);
+
+#endif
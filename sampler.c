@@ -0,0 +1,173 @@
+#include "sampler.h"
+#include "object.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Samples per second of CPU time.
+#define SAMPLER_HZ 1000
+// Runaway recursion would make every sample enormous, only the innermost frames are kept.
+#define SAMPLE_FRAMES_MAX 128
+
+volatile sig_atomic_t samplePending = 0;
+
+// A distinct collapsed stack and how many samples saw it.
+typedef struct {
+	char *stack;
+	uint32_t hash;
+	int count;
+} StackCount;
+
+static const char *outputPath;
+// Open-addressed on the stack's hash, so memory grows with the number of distinct stacks rather
+// than with the number of samples. The capacity is a power of two, unused entries have no stack.
+static StackCount *stacks;
+static int stackCount;
+static int stackCapacity;
+// The stack being collapsed.
+static char *buffer;
+static size_t bufferLength;
+static size_t bufferCapacity;
+
+static void onProfileSignal(int signal) {
+	(void)signal;
+	samplePending = 1;
+}
+
+static void append(const char *text, size_t length) {
+	if (bufferLength + length + 1 > bufferCapacity) {
+		bufferCapacity = (bufferLength + length + 1) * 2;
+		buffer = realloc(buffer, bufferCapacity);
+		if (buffer == NULL)
+			exit(1);
+	}
+	memcpy(buffer + bufferLength, text, length);
+	bufferLength += length;
+	buffer[bufferLength] = '\0';
+}
+
+static StackCount *findStack(StackCount *entries, int capacity, const char *stack, size_t length,
+							 uint32_t hash) {
+	uint32_t index = hash & (capacity - 1);
+	for (;;) {
+		StackCount *entry = &entries[index];
+		if (entry->stack == NULL ||
+			(entry->hash == hash && strlen(entry->stack) == length &&
+			 memcmp(entry->stack, stack, length) == 0))
+			return entry;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+static void growStacks() {
+	int capacity = stackCapacity < 256 ? 256 : stackCapacity * 2;
+	StackCount *entries = calloc(capacity, sizeof(StackCount));
+	if (entries == NULL)
+		exit(1);
+	for (int i = 0; i < stackCapacity; i++) {
+		StackCount *entry = &stacks[i];
+		if (entry->stack == NULL)
+			continue;
+		*findStack(entries, capacity, entry->stack, strlen(entry->stack), entry->hash) = *entry;
+	}
+	free(stacks);
+	stacks = entries;
+	stackCapacity = capacity;
+}
+
+void takeSample() {
+	samplePending = 0;
+	bufferLength = 0;
+	// Outermost frame first, the order flame graphs stack them in.
+	int first = 0;
+	if (vm.frameCount > SAMPLE_FRAMES_MAX) {
+		first = vm.frameCount - SAMPLE_FRAMES_MAX;
+		append("...;", 4);
+	}
+	for (int i = first; i < vm.frameCount; i++) {
+		CallFrame *frame = &vm.frames[i];
+		ObjString *name = frame->function->name;
+		char line[16];
+		int lineLength = snprintf(line, sizeof(line), ":%d", frameLine(frame));
+		if (i > first)
+			append(";", 1);
+		if (name == NULL) {
+			append("script", 6);
+		} else {
+			append(name->chars, name->length);
+		}
+		append(line, lineLength);
+	}
+
+	// Kept at most three quarters full so probing stays short.
+	if ((stackCount + 1) * 4 > stackCapacity * 3)
+		growStacks();
+	uint32_t hash = hashString(buffer, (int)bufferLength);
+	StackCount *entry = findStack(stacks, stackCapacity, buffer, bufferLength, hash);
+	if (entry->stack == NULL) {
+		entry->stack = malloc(bufferLength + 1);
+		if (entry->stack == NULL)
+			exit(1);
+		memcpy(entry->stack, buffer, bufferLength + 1);
+		entry->hash = hash;
+		stackCount++;
+	}
+	entry->count++;
+}
+
+static int compareStacks(const void *a, const void *b) {
+	return strcmp(((const StackCount *)a)->stack, ((const StackCount *)b)->stack);
+}
+
+static void writeSamples() {
+	struct itimerval off = {0};
+	setitimer(ITIMER_PROF, &off, NULL);
+
+	// The table is freed below, so the stacks are packed to its front and sorted there to write the
+	// file in a stable order.
+	int used = 0;
+	for (int i = 0; i < stackCapacity; i++) {
+		if (stacks[i].stack != NULL)
+			stacks[used++] = stacks[i];
+	}
+	qsort(stacks, used, sizeof(StackCount), compareStacks);
+
+	FILE *file = fopen(outputPath, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Could not write samples to \"%s\".\n", outputPath);
+	} else {
+		for (int i = 0; i < used; i++) {
+			fprintf(file, "%s %d\n", stacks[i].stack, stacks[i].count);
+		}
+		fclose(file);
+	}
+
+	for (int i = 0; i < used; i++) {
+		free(stacks[i].stack);
+	}
+	free(stacks);
+	free(buffer);
+}
+
+bool startSampler(const char *path) {
+	outputPath = path;
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onProfileSignal;
+	sigemptyset(&action.sa_mask);
+	// The VM may be blocked in a read, e.g. the REPL, the signal mustn't fail it with EINTR.
+	action.sa_flags = SA_RESTART;
+	if (sigaction(SIGPROF, &action, NULL) != 0)
+		return false;
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / SAMPLER_HZ;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, NULL) != 0)
+		return false;
+	atexit(writeSamples);
+	return true;
+}
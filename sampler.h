@@ -0,0 +1,19 @@
+#ifndef clox_sampler_h
+#define clox_sampler_h
+
+#include "common.h"
+#include <signal.h>
+
+// Set from the SIGPROF handler, taken and cleared by the VM at its next safepoint. The handler
+// itself can't walk the stack: run() keeps the current ip in a local, so the top frame's ip is
+// stale until the loop writes it back.
+extern volatile sig_atomic_t samplePending;
+
+// Samples the Lox call stack SAMPLER_HZ times per second of CPU time until the process exits, then
+// writes the samples to `path` as collapsed stacks ("script:12;fib:4;fib:5 42" per line), the
+// input flamegraph.pl and speedscope read. Returns false if the timer can't be set up.
+bool startSampler(const char *path);
+// Records vm.frames as one sample. Every frame's ip has to be current.
+void takeSample();
+
+#endif
@@ -89,6 +89,7 @@ static void skipWhitespace() {
 			} else {
 				return;
 			}
+			break;
 		default:
 			return;
 		}
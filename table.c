@@ -6,90 +6,159 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define TABLE_MAX_LOAD 0.75
 
+// Swiss-table layout: next to the entries sits one control byte per slot. A full slot stores the
+// low 7 bits of its key's hash there (H2), so a probe can rule out most slots without touching the
+// entries at all. Slots are probed a group of GROUP_SIZE control bytes at a time, and the remaining
+// hash bits (H1) pick the group a probe starts at.
+#define GROUP_SIZE 16
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xfe)
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7f))
+
 void initTable(Table *table) {
 	table->count = 0;
 	table->capacity = 0;
 	table->entries = NULL;
+	table->control = NULL;
 }
 
 void freeTable(Table *table) {
 	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(uint8_t, table->control, table->capacity);
 	initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-	uint32_t index = key->hash % capacity;
-	Entry *tombstone = NULL;
-	for (;;) {
-		Entry *entry = &entries[index];
-		if (entry->key == NULL) {
-			if (IS_NIL(entry->value)) {
-				// Empty entry.
-				return tombstone != NULL ? tombstone : entry;
-			} else {
-				// We found a tombstone.
-				if (tombstone == NULL)
-					tombstone = entry;
-			}
-		} else if (entry->key == key) {
-			// We found the key.
-			return entry;
+// Bit i of the result is set when control byte i of the group equals `byte`.
+static inline uint32_t matchByte(const uint8_t *group, uint8_t byte) {
+#ifdef __SSE2__
+	__m128i controls = _mm_loadu_si128((const __m128i *)group);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(controls, _mm_set1_epi8((char)byte)));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < GROUP_SIZE; i++) {
+		if (group[i] == byte)
+			mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+// Bit i is set when slot i of the group is empty or deleted, i.e. free to insert into. Both have
+// the top bit set, full slots never do.
+static inline uint32_t matchFree(const uint8_t *group) {
+#ifdef __SSE2__
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < GROUP_SIZE; i++) {
+		if (group[i] & 0x80)
+			mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+// Capacities are powers of two and at least one group, so groups are aligned and the probe
+// sequence is just the next group, wrapping around.
+static inline int groupMask(int capacity) { return capacity / GROUP_SIZE - 1; }
+
+// Index of the slot holding `key`, or -1. A group with an empty slot ends the probe, the key
+// would have been inserted there. Deleted slots don't, keys may have been placed beyond them.
+static int findKey(uint8_t *control, Entry *entries, int capacity, ObjString *key) {
+	int mask = groupMask(capacity);
+	uint8_t h2 = H2(key->hash);
+	for (uint32_t group = H1(key->hash) & mask;; group = (group + 1) & mask) {
+		uint8_t *controls = control + group * GROUP_SIZE;
+		for (uint32_t match = matchByte(controls, h2); match != 0; match &= match - 1) {
+			int index = group * GROUP_SIZE + __builtin_ctz(match);
+			if (entries[index].key == key)
+				return index;
 		}
+		if (matchByte(controls, CTRL_EMPTY) != 0)
+			return -1;
+	}
+}
 
-		index = (index + 1) % capacity;
+// Index of the first empty or deleted slot along the key's probe sequence. The load factor
+// guarantees there is one.
+static int findFree(uint8_t *control, int capacity, uint32_t hash) {
+	int mask = groupMask(capacity);
+	for (uint32_t group = H1(hash) & mask;; group = (group + 1) & mask) {
+		uint32_t match = matchFree(control + group * GROUP_SIZE);
+		if (match != 0)
+			return group * GROUP_SIZE + __builtin_ctz(match);
 	}
 }
+
 bool tableGet(Table *table, ObjString *key, Value *value) {
 	if (table->count == 0)
 		return false;
 
-	Entry *entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL)
+	int index = findKey(table->control, table->entries, table->capacity, key);
+	if (index < 0)
 		return false;
 
-	*value = entry->value;
+	*value = table->entries[index].value;
 	return true;
 }
+
 static void adjustCapacity(Table *table, int capacity) {
 	Entry *entries = ALLOCATE(Entry, capacity);
+	uint8_t *control = ALLOCATE(uint8_t, capacity);
 	for (int i = 0; i < capacity; i++) {
 		entries[i].key = NULL;
 		entries[i].value = NIL_VAL;
 	}
+	memset(control, CTRL_EMPTY, capacity);
+	// Tombstones are dropped along the way, so only live keys count afterwards.
 	table->count = 0;
 	for (int i = 0; i < table->capacity; i++) {
 		Entry *entry = &table->entries[i];
 		if (entry->key == NULL)
 			continue;
 
-		Entry *dest = findEntry(entries, capacity, entry->key);
-		dest->key = entry->key;
-		dest->value = entry->value;
+		int index = findFree(control, capacity, entry->key->hash);
+		control[index] = H2(entry->key->hash);
+		entries[index] = *entry;
 		table->count++;
 	}
 	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(uint8_t, table->control, table->capacity);
 	table->entries = entries;
+	table->control = control;
 	table->capacity = capacity;
 }
 
 bool tableSet(Table *table, ObjString *key, Value value) {
+	// Adds the given key value pair to the given hash table
+	// returns true if a new entry was added
+	if (table->count > 0) {
+		int index = findKey(table->control, table->entries, table->capacity, key);
+		if (index >= 0) {
+			table->entries[index].value = value;
+			return false;
+		}
+	}
 	if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-		int capacity = GROW_CAPACITY(table->capacity);
+		int capacity = table->capacity < GROUP_SIZE ? GROUP_SIZE : table->capacity * 2;
 		adjustCapacity(table, capacity);
 	}
-	// Adds the given key value pair to the given hash table
-	// returns true if a new entry was added
-	//
-	Entry *entry = findEntry(table->entries, table->capacity, key);
-	bool isNewKey = entry->key == NULL;
-	if (isNewKey && IS_NIL(entry->value))
+	int index = findFree(table->control, table->capacity, key->hash);
+	// Like the entries array before, count includes tombstones, so reusing one doesn't add to it.
+	if (table->control[index] == CTRL_EMPTY)
 		table->count++;
-
-	entry->key = key;
-	entry->value = value;
-	return isNewKey;
+	table->control[index] = H2(key->hash);
+	table->entries[index].key = key;
+	table->entries[index].value = value;
+	return true;
 }
 
 bool tableDelete(Table *table, ObjString *key) {
@@ -97,13 +166,15 @@ bool tableDelete(Table *table, ObjString *key) {
 		return false;
 
 	// Find the entry.
-	Entry *entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL)
+	int index = findKey(table->control, table->entries, table->capacity, key);
+	if (index < 0)
 		return false;
 
-	// Place a tombstone in the entry.
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);
+	// Place a tombstone in the entry. The entry itself is cleared too, so code walking the entries
+	// only has to check for a NULL key.
+	table->control[index] = CTRL_DELETED;
+	table->entries[index].key = NULL;
+	table->entries[index].value = BOOL_VAL(true);
 	return true;
 }
 
@@ -117,22 +188,45 @@ void tableAddAll(Table *from, Table *to) {
 }
 
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash) {
-	// Similar to findEntry
-	// But works for interned strings, we first check length, then hash, then character comparison
-	// To definitively determine what entry is there.
+	// Similar to findKey
+	// But works for interned strings, the control byte filters on 7 bits of the hash, then we check
+	// length, the full hash and finally the characters to definitively determine what entry is
+	// there.
 	if (table->count == 0)
 		return NULL;
-	uint32_t index = hash % table->capacity;
-	for (;;) {
-		Entry *entry = &table->entries[index];
-		if (entry->key == NULL) {
-			// Stop if we find an empty non-tombstone entry
-			if (IS_NIL(entry->value))
-				return NULL;
-		} else if (entry->key->length == length && entry->key->hash == hash &&
-				   memcmp(entry->key->chars, chars, length) == 0) {
-			return entry->key;
+	int mask = groupMask(table->capacity);
+	uint8_t h2 = H2(hash);
+	for (uint32_t group = H1(hash) & mask;; group = (group + 1) & mask) {
+		uint8_t *controls = table->control + group * GROUP_SIZE;
+		for (uint32_t match = matchByte(controls, h2); match != 0; match &= match - 1) {
+			ObjString *key = table->entries[group * GROUP_SIZE + __builtin_ctz(match)].key;
+			if (key->length == length && key->hash == hash &&
+				memcmp(key->chars, chars, length) == 0) {
+				return key;
+			}
 		}
-		index = (index + 1) % table->capacity;
+		// Stop if the group has an empty non-tombstone slot
+		if (matchByte(controls, CTRL_EMPTY) != 0)
+			return NULL;
+	}
+}
+
+// vm.strings doesn't keep its strings alive. Before the sweep frees the unmarked ones, drop them
+// from the table so it doesn't end up holding dangling keys.
+void tableRemoveWhite(Table *table) {
+	for (int i = 0; i < table->capacity; i++) {
+		Entry *entry = &table->entries[i];
+		// Young strings aren't traced by a full collection, the next minor one decides their fate.
+		if (entry->key != NULL && !IS_YOUNG(entry->key) && !entry->key->obj.isMarked) {
+			tableDelete(table, entry->key);
+		}
+	}
+}
+
+void markTable(Table *table) {
+	for (int i = 0; i < table->capacity; i++) {
+		Entry *entry = &table->entries[i];
+		markObject((Obj *)entry->key);
+		markValue(entry->value);
 	}
 }
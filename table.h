@@ -14,8 +14,11 @@ typedef struct {
 
 typedef struct {
 	int count;
+	// Always a power of two and a multiple of the probe group size, see table.c.
 	int capacity;
 	Entry *entries;
+	// One control byte per entry: empty, deleted, or 7 bits of the key's hash.
+	uint8_t *control;
 } Table;
 
 void initTable(Table *table);
@@ -24,6 +27,8 @@ bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
+void tableRemoveWhite(Table *table);
+void markTable(Table *table);
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
 
 #endif
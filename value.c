@@ -37,20 +37,48 @@ void freeValueArray(ValueArray *array) {
 	initValueArray(array);
 }
 int printValue(Value value) {
-	switch (value.type) {
-	case VAL_BOOL:
+	// Only the IS_* macros are used here so both Value layouts share this code.
+	if (IS_BOOL(value)) {
 		return printf(AS_BOOL(value) ? "true" : "false");
-	case VAL_NIL:
+	} else if (IS_NIL(value)) {
 		return printf("nil");
-	case VAL_NUMBER:
+	} else if (IS_NUMBER(value)) {
 		return printf("%g", AS_NUMBER(value));
-	case VAL_OBJ:
+	} else if (IS_OBJ(value)) {
 		return printObject(value);
 	}
 	return 0;
 }
 
+// Interned strings are the same object exactly when their characters match. Runtime strings are
+// only interned on demand, so when one side isn't, the characters are compared, with the cached
+// hashes as a quick reject. This never allocates.
+static bool stringsEqual(ObjString *a, ObjString *b) {
+	if (a == b)
+		return true;
+	if (a->isInterned && b->isInterned)
+		return false;
+	return a->length == b->length && stringHash(a) == stringHash(b) &&
+		   memcmp(a->chars, b->chars, a->length) == 0;
+}
+
 bool valuesEqual(Value a, Value b) {
+	// A rope is equal to the string it spells out. Callers keep both values reachable, flattening
+	// allocates.
+	if (IS_ROPE(a))
+		a = OBJ_VAL(flattenRope(AS_ROPE(a)));
+	if (IS_ROPE(b))
+		b = OBJ_VAL(flattenRope(AS_ROPE(b)));
+	if (IS_STRING(a) && IS_STRING(b))
+		return stringsEqual(AS_STRING(a), AS_STRING(b));
+#ifdef NAN_BOXING
+	// Numbers are still compared as doubles so that NaN != NaN holds.
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		return AS_NUMBER(a) == AS_NUMBER(b);
+	}
+	// Singletons and interned strings are equal exactly when their bits are.
+	return a == b;
+#else
 	if (a.type != b.type)
 		return false;
 	switch (a.type) {
@@ -68,4 +96,5 @@ bool valuesEqual(Value a, Value b) {
 	default:
 		return false;
 	}
+#endif
 }
@@ -5,11 +5,64 @@
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// Every double that isn't a NaN is stored as-is. All other values are packed into the unused bits
+// of a quiet NaN, so a Value is a single 64-bit word instead of a tagged struct.
+// https://craftinginterpreters.com/optimization.html#nan-boxing
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+// The lowest two bits of a singleton value tell nil and the booleans apart.
+#define TAG_NIL 1	// 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE 3	// 11.
+#define TAG_UNDEFINED 4
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+// Objects set the sign bit on top of the quiet NaN, the pointer lives in the low 48 bits.
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num) numToValue(num)
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+static inline double valueToNum(Value value) {
+	// memcpy is the portable way to type-pun, compilers turn it into a plain register move.
+	double num;
+	memcpy(&num, &value, sizeof(Value));
+	return num;
+}
+
+static inline Value numToValue(double num) {
+	Value value;
+	memcpy(&value, &num, sizeof(double));
+	return value;
+}
+
+#else
+
 typedef enum {
 	VAL_BOOL,
 	VAL_NIL,
 	VAL_NUMBER,
 	VAL_OBJ,
+	VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -21,14 +74,9 @@ typedef struct {
 	} as;
 } Value;
 
-typedef struct {
-	int capacity;
-	int count;
-	Value *values;
-} ValueArray;
-
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
@@ -38,9 +86,21 @@ typedef struct {
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
+#endif
+
+// UNDEFINED_VAL never reaches Lox code. It marks a global slot the compiler has handed out but
+// that no `var` or `fun` has defined yet.
+
+typedef struct {
+	int capacity;
+	int count;
+	Value *values;
+} ValueArray;
+
 // We pass an uninitialized ValueArray and fill its values
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray *array);
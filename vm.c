@@ -3,14 +3,20 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "profile.h"
+#include "regcompiler.h"
+#include "sampler.h"
 #include "table.h"
 #include "value.h"
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 VM vm;
 
@@ -20,6 +26,19 @@ static void resetStack() {
 	vm.frameCount = 0;
 }
 
+// Innermost frames printed in a stack trace.
+#define TRACE_FRAMES_MAX 32
+
+int frameLine(CallFrame *frame) {
+	// Frames run by the register backend point into the function's register chunk.
+	Chunk *chunk = &frame->function->chunk;
+	Chunk *regChunk = &frame->function->regChunk;
+	if (frame->ip > regChunk->code && frame->ip <= regChunk->code + regChunk->count)
+		chunk = regChunk;
+	size_t instruction = frame->ip - chunk->code - 1;
+	return getLine(chunk, (int)instruction);
+}
+
 // Special variable arguments syntax
 static void runtimeError(const char *format, ...) {
 	va_list args;
@@ -32,12 +51,16 @@ static void runtimeError(const char *format, ...) {
 	// The call frames are stock inside vm.frames
 	// We can walk the list up until fm.frameCount
 	for (int i = vm.frameCount - 1; i > 0; i--) {
+		// Runaway recursion can be hundreds of thousands of frames deep, only show where it ended.
+		if (i == vm.frameCount - 1 - TRACE_FRAMES_MAX) {
+			fprintf(stderr, "... %d more frames\n", i);
+			break;
+		}
 		CallFrame *frame = &vm.frames[i];
 		// What info do we have in the frame
 		// We can pull out the name of the function
 		// And the line where the function was executing.
-		size_t instruction = frame->ip - frame->function->chunk.code - 1;
-		int line = frame->function->chunk.lines[instruction];
+		int line = frameLine(frame);
 		if (frame->function->name == NULL) {
 			fprintf(stderr, "[Line #%d] script\n", line);
 		} else {
@@ -47,18 +70,82 @@ static void runtimeError(const char *format, ...) {
 
 	resetStack();
 }
+// Processor time used so far, in seconds.
+static Value clockNative(int argCount, Value *args) {
+	(void)argCount;
+	(void)args;
+	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+}
+
+// Monotonic wall clock in nanoseconds, for scripts timing themselves. Only differences between two
+// readings mean anything.
+static Value nanoTimeNative(int argCount, Value *args) {
+	(void)argCount;
+	(void)args;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return NUMBER_VAL((double)now.tv_sec * 1e9 + (double)now.tv_nsec);
+}
+
 void initVM() {
+	vm.stack = (Value *)malloc(sizeof(Value) * STACK_INITIAL);
+	vm.frames = (CallFrame *)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+	if (vm.stack == NULL || vm.frames == NULL)
+		exit(1);
+	vm.stackCapacity = STACK_INITIAL;
+	vm.frameCapacity = FRAMES_INITIAL;
 	resetStack();
 	vm.objects = NULL;
+	vm.bytesAllocated = 0;
+	vm.nextGC = 1024 * 1024;
+	vm.grayCount = 0;
+	vm.grayCapacity = 0;
+	vm.grayStack = NULL;
+	initNursery();
+	vm.backend = BACKEND_STACK;
+#ifdef JIT
+	// Measured from here, close enough to the bottom of the stack.
+	vm.jitStackLimit = (uintptr_t)__builtin_frame_address(0) - JIT_STACK_MAX;
+	vm.exitFrameCount = 0;
+#endif
 	// We pass a pointer to the vm strings table,
 	initTable(&vm.globals);
+	initValueArray(&vm.globalValues);
+	initValueArray(&vm.globalNames);
 	initTable(&vm.strings);
+
+	defineNative("clock", clockNative, 0);
+	defineNative("nanoTime", nanoTimeNative, 0);
+#ifdef PROFILE_OPCODES
+	initProfile();
+#endif
 }
 
 void freeVM() {
 	freeTable(&vm.strings);
 	freeTable(&vm.globals);
+	freeValueArray(&vm.globalValues);
+	freeValueArray(&vm.globalNames);
 	freeObjects();
+	freeNursery();
+	free(vm.stack);
+	free(vm.frames);
+	vm.stack = NULL;
+	vm.frames = NULL;
+}
+
+int globalSlot(ObjString *name) {
+	Value slot;
+	if (tableGet(&vm.globals, name, &slot))
+		return (int)AS_NUMBER(slot);
+	int index = vm.globalValues.count;
+	// The name is usually a fresh string from the compiler, keep it alive while the arrays grow.
+	push(OBJ_VAL(name));
+	writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+	writeValueArray(&vm.globalNames, OBJ_VAL(name));
+	tableSet(&vm.globals, name, NUMBER_VAL(index));
+	pop();
+	return index;
 }
 
 void push(Value value) {
@@ -76,73 +163,469 @@ static bool isFalsey(Value value) { return IS_NIL(value) || (IS_BOOL(value) && !
 static void concatenate() {
 	// We want to get the 2 strings off the value stack.
 	// Then we allocate a new piece of memory with the length of both strings
-	ObjString *b = AS_STRING(pop());
-	ObjString *a = AS_STRING(pop());
-	int length = a->length + b->length;
-	char *chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
-
-	ObjString *result = takeString(chars, length);
+	// They stay on the stack until the result exists, allocating it can trigger a collection.
+	int length = stringLength(peek(0)) + stringLength(peek(1));
+	if (length >= ROPE_MIN_LENGTH) {
+		// Long results only record their halves, so building a string up in a loop doesn't copy
+		// everything built so far on each step. The characters are copied once, when needed.
+		ObjRope *rope = newRope(peek(1), peek(0));
+		pop();
+		pop();
+		push(OBJ_VAL(rope));
+		return;
+	}
+	// Every rope is at least ROPE_MIN_LENGTH long, so both operands are flat strings here.
+	ObjString *result = allocateYoungString(length);
+	// A minor collection may have moved both operands, so only read them now.
+	ObjString *b = AS_STRING(peek(0));
+	ObjString *a = AS_STRING(peek(1));
+	memcpy(result->chars, a->chars, a->length);
+	memcpy(result->chars + a->length, b->chars, b->length);
+	// Not hashed or interned here, most results are only ever printed or concatenated again.
+	pop();
+	pop();
 	push(OBJ_VAL(result));
 }
 
-static bool call(ObjFunction *function, int argCount) {
-	if (argCount != function->arity) {
-		runtimeError("The number of arguments given %d which doesn't match expected %d", argCount,
-					 function->arity);
+// Sets up the callee's frame over the arguments already on the stack. Shared by call() and the
+// inline cache fast path in run(), which has already done the checks.
+static inline void pushFrame(ObjFunction *function, int argCount) {
+	CallFrame *frame = &vm.frames[vm.frameCount++];
+	frame->function = function;
+	frame->ip = function->chunk.code;
+	frame->slots = vm.stackTop - argCount - 1;
+}
+
+// Whether a frame for function starting at base fits in the value stack without growing it.
+static inline bool stackFits(ObjFunction *function, Value *base) {
+	return (base - vm.stack) + frameSize(function) <= vm.stackCapacity;
+}
+
+// Whether a call of function with its arguments on top of the stack fits without growing.
+static inline bool hasRoom(ObjFunction *function, int argCount) {
+	return vm.frameCount < vm.frameCapacity && stackFits(function, vm.stackTop - argCount - 1);
+}
+
+static bool growFrames() {
+	if (vm.frameCapacity >= FRAMES_MAX) {
+		runtimeError("Stack overflow frames=%d", vm.frameCount);
 		return false;
 	}
-	// We also need to check that the call stack isn't too deep
-	if (vm.frameCount == FRAMES_MAX) {
-		runtimeError("Stack overflow frames=%d", FRAMES_MAX);
+	int capacity = vm.frameCapacity * 2 < FRAMES_MAX ? vm.frameCapacity * 2 : FRAMES_MAX;
+	vm.frames = (CallFrame *)realloc(vm.frames, sizeof(CallFrame) * capacity);
+	if (vm.frames == NULL)
+		exit(1);
+	vm.frameCapacity = capacity;
+	return true;
+}
+
+// Grows the value stack, up to STACK_MAX, until a frame for function starting at base fits. Every
+// frame's slots and stackTop are moved along with it, the interpreter loops reload theirs from the
+// frame afterwards.
+static bool growStack(ObjFunction *function, Value *base) {
+	size_t needed = (size_t)(base - vm.stack) + frameSize(function);
+	if (needed > STACK_MAX) {
+		runtimeError("Stack overflow frames=%d", vm.frameCount);
 		return false;
 	}
-	CallFrame *frame = &vm.frames[vm.frameCount++];
+	size_t capacity = (size_t)vm.stackCapacity;
+	while (capacity < needed)
+		capacity *= 2;
+	if (capacity > STACK_MAX)
+		capacity = STACK_MAX;
+	// Offsets are taken as integers, the old block is gone once realloc() moves it.
+	uintptr_t oldStack = (uintptr_t)vm.stack;
+	Value *stack = (Value *)realloc(vm.stack, sizeof(Value) * capacity);
+	if (stack == NULL)
+		exit(1);
+	for (int i = 0; i < vm.frameCount; i++) {
+		vm.frames[i].slots = stack + ((uintptr_t)vm.frames[i].slots - oldStack) / sizeof(Value);
+	}
+	vm.stackTop = stack + ((uintptr_t)vm.stackTop - oldStack) / sizeof(Value);
+	vm.stack = stack;
+	vm.stackCapacity = (int)capacity;
+	return true;
+}
+
+// Makes room for a call that doesn't fit, see hasRoom().
+static bool growStacks(ObjFunction *function, int argCount) {
+	if (vm.frameCount == vm.frameCapacity && !growFrames())
+		return false;
+	Value *base = vm.stackTop - argCount - 1;
+	return stackFits(function, base) || growStack(function, base);
+}
+
+static bool checkArity(int arity, int argCount) {
+	if (argCount != arity) {
+		runtimeError("The number of arguments given %d which doesn't match expected %d", argCount,
+					 arity);
+		return false;
+	}
+	return true;
+}
+
+// Natives run on the caller's stack, the arguments are the top argCount values. The result
+// replaces them and the callee, no frame is pushed.
+static inline bool callNative(ObjNative *native, int argCount) {
+	if (!checkArity(native->arity, argCount))
+		return false;
+	Value result = native->function(argCount, vm.stackTop - argCount);
+	vm.stackTop -= argCount + 1;
+	push(result);
+	return true;
+}
+
+static bool call(ObjFunction *function, int argCount) {
+	if (!checkArity(function->arity, argCount))
+		return false;
+	// We also need to check that the callee's frame fits
+	if (!hasRoom(function, argCount) && !growStacks(function, argCount))
+		return false;
+	pushFrame(function, argCount);
+	return true;
+}
+
+// Turns the current frame into one for function, which is on top of the stack with its arguments.
+// They slide down to the frame's slots, so a chain of tail calls stays in one frame. The caller
+// reloads its cached slots pointer, growing the stack may move it.
+static bool replaceFrame(CallFrame *frame, ObjFunction *function, int argCount) {
+	if (!checkArity(function->arity, argCount))
+		return false;
+	memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+	vm.stackTop = frame->slots + argCount + 1;
+	if (!stackFits(function, frame->slots) && !growStack(function, frame->slots))
+		return false;
 	frame->function = function;
+	return true;
+}
+
+// OP_TAIL_CALL of a function: the current frame becomes the callee's, ready to run from its first
+// instruction. The inline cache vouches for the arity of a callee it has seen before.
+static bool tailCall(CallFrame *frame, ObjFunction *function, int argCount, CallCache *cache) {
+	if ((Obj *)function == cache->callee) {
+		// Only the stack can still be too small.
+		memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+		vm.stackTop = frame->slots + argCount + 1;
+		if (!stackFits(function, frame->slots) && !growStack(function, frame->slots))
+			return false;
+		frame->function = function;
+	} else {
+		if (!replaceFrame(frame, function, argCount))
+			return false;
+		cache->callee = (Obj *)function;
+	}
 	frame->ip = function->chunk.code;
-	frame->slots = vm.stackTop - argCount - 1;
 	return true;
 }
 
+// Moves vm.stackTop to the end of a new frame's register window. The registers past the arguments
+// may hold leftovers from frames that have already returned, and the collector marks everything
+// below stackTop, so they're cleared first.
+static void enterRegisterWindow(Value *end) {
+	for (Value *slot = vm.stackTop; slot < end; slot++) {
+		*slot = NIL_VAL;
+	}
+	vm.stackTop = end;
+}
+
+// Globals are the main place old memory points into the nursery, so every store goes through the
+// write barrier.
+static inline void setGlobal(int slot, Value value) {
+	WRITE_BARRIER(&vm.globalValues, slot, value);
+	vm.globalValues.values[slot] = value;
+}
+
+void defineNative(const char *name, NativeFn function, int arity) {
+	// Both objects stay on the stack while the other one and the global's slot are allocated.
+	push(OBJ_VAL(copyString(name, (int)strlen(name))));
+	push(OBJ_VAL(newNative(function, arity, AS_STRING(peek(0)))));
+	setGlobal(globalSlot(AS_STRING(peek(1))), peek(0));
+	pop();
+	pop();
+}
+
+static InterpretResult run();
+static InterpretResult runRegisters();
+
+// Both loops poll for a pending sample at loops, calls and returns, the points where the frame's ip
+// can cheaply be written back for the sampler to read. That is one load and branch when sampling
+// is off. Uses the SAVE_FRAME() of the loop it expands in.
+#define SAFEPOINT()                                                                                \
+	do {                                                                                           \
+		if (samplePending) {                                                                       \
+			SAVE_FRAME();                                                                          \
+			takeSample();                                                                          \
+		}                                                                                          \
+	} while (false)
+
+#ifdef JIT
+// Runs the top frame in a nested run() that stops once it returns. Used for the frames of calls
+// made by native code that don't run natively, from wherever they are.
+static bool interpretCallee() {
+	int exitFrameCount = vm.exitFrameCount;
+	vm.exitFrameCount = vm.frameCount - 1;
+	InterpretResult result = run();
+	vm.exitFrameCount = exitFrameCount;
+	return result == INTERPRET_OK;
+}
+
+// Runs the top frame, which is at its first instruction, until it returns.
+static bool finishCall() {
+	ObjFunction *function = vm.frames[vm.frameCount - 1].function;
+	if (jitWarm(function) && jitStackFits()) {
+		JitResult result = jitEnter(function, function->chunk.code);
+		if (result != JIT_EXITED)
+			return result == JIT_RETURNED;
+	}
+	return interpretCallee();
+}
+
+int jitCall(int argCount, CallCache *cache) {
+	Value callee = peek(argCount);
+	if (IS_FUNCTION(callee)) {
+		ObjFunction *function = AS_FUNCTION(callee);
+		if ((Obj *)function == cache->callee) {
+			if (!hasRoom(function, argCount) && !growStacks(function, argCount))
+				return JIT_CALL_ERROR;
+			pushFrame(function, argCount);
+		} else {
+			if (!call(function, argCount))
+				return JIT_CALL_ERROR;
+			cache->callee = (Obj *)function;
+		}
+		if (jitWarm(function) && jitStackFits())
+			return JIT_CALL_PUSHED;
+		return interpretCallee() ? JIT_CALL_DONE : JIT_CALL_ERROR;
+	}
+	if (IS_NATIVE(callee))
+		return callNative(AS_NATIVE(callee), argCount) ? JIT_CALL_DONE : JIT_CALL_ERROR;
+	runtimeError("Can only call functions.");
+	return JIT_CALL_ERROR;
+}
+
+bool jitResume(JitResult result) {
+	switch (result) {
+	case JIT_RETURNED:
+		return true;
+	case JIT_TAIL_CALL:
+		return finishCall();
+	case JIT_EXITED:
+		return interpretCallee();
+	default:
+		return false;
+	}
+}
+
+int jitTailCall(int argCount, CallCache *cache) {
+	Value callee = peek(argCount);
+	if (IS_FUNCTION(callee)) {
+		CallFrame *frame = &vm.frames[vm.frameCount - 1];
+		if (!tailCall(frame, AS_FUNCTION(callee), argCount, cache))
+			return JIT_CALL_ERROR;
+		return JIT_CALL_REPLACED;
+	}
+	if (IS_NATIVE(callee))
+		return callNative(AS_NATIVE(callee), argCount) ? JIT_CALL_DONE : JIT_CALL_ERROR;
+	runtimeError("Can only call functions.");
+	return JIT_CALL_ERROR;
+}
+
+// The native code has already added the numbers, only strings are left.
+bool jitAdd() {
+	if (IS_STRING_LIKE(peek(0)) && IS_STRING_LIKE(peek(1))) {
+		concatenate();
+		return true;
+	}
+	runtimeError("Operands must be two numbers or two strings.");
+	return false;
+}
+
+void jitEqual() {
+	bool equal = valuesEqual(peek(1), peek(0));
+	pop();
+	pop();
+	push(BOOL_VAL(equal));
+}
+
+void jitPrint() {
+	printValue(peek(0));
+	pop();
+	printf("\n");
+}
+
+void jitDefineGlobal(int slot) {
+	setGlobal(slot, peek(0));
+	pop();
+}
+
+void jitSetGlobal(int slot) { setGlobal(slot, peek(0)); }
+#endif
+
 InterpretResult interpret(const char *source) {
 	ObjFunction *function = compile(source);
 	if (function == NULL)
 		return INTERPRET_RUNTIME_ERROR;
+	return interpretFunction(function);
+}
+
+InterpretResult interpretFunction(ObjFunction *function) {
+	// On the stack before anything else allocates, so a collection can't free it.
 	push(OBJ_VAL(function));
-	if (call(function, 0)) {
-		return run();
-	} else {
+	bool registers = false;
+	if (vm.backend == BACKEND_REGISTER) {
+		registers = compileRegisters(function);
+		if (!registers)
+			fprintf(stderr, "Register backend can't run this program, using the stack VM.\n");
+	}
+	if (!call(function, 0))
 		return INTERPRET_RUNTIME_ERROR;
+	if (registers) {
+		CallFrame *frame = &vm.frames[vm.frameCount - 1];
+		frame->ip = function->regChunk.code;
+		enterRegisterWindow(frame->slots + function->regCount);
+		return runRegisters();
 	}
+	return run();
 }
 
 static InterpretResult run() {
 	// Get the current frame
 	CallFrame *frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+	// The hottest frame state is cached in locals so the compiler can keep it in registers.
+	// It is only written back to the frame when another frame needs to see it, i.e. at calls,
+	// returns and runtime errors (the stack trace reads every frame's ip).
+	register uint8_t *ip = frame->ip;
+	Value *slots = frame->slots;
+	Value *constants = frame->function->chunk.constants.values;
+	CallCache *callCaches = frame->function->chunk.callCaches;
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_GLOBAL() (READ_SHORT())
+#define GLOBAL_NAME(slot) (AS_STRING(vm.globalNames.values[slot])->chars)
+#define SAVE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME()                                                                               \
+	do {                                                                                           \
+		frame = &vm.frames[vm.frameCount - 1];                                                     \
+		ip = frame->ip;                                                                            \
+		slots = frame->slots;                                                                      \
+		constants = frame->function->chunk.constants.values;                                      \
+		callCaches = frame->function->chunk.callCaches;                                            \
+	} while (false)
+#define RUNTIME_ERROR(...)                                                                         \
+	do {                                                                                           \
+		SAVE_FRAME();                                                                              \
+		runtimeError(__VA_ARGS__);                                                                 \
+		return INTERPRET_RUNTIME_ERROR;                                                            \
+	} while (false)
+#ifdef JIT
+// Counts a call or loop iteration of the top frame's function and, once it is compiled, runs the
+// frame natively from ip. The native code stops when the frame returns, leaving the caller on top,
+// or at an instruction it leaves to the interpreter.
+#define ENTER_NATIVE()                                                                             \
+	do {                                                                                           \
+		if (jitWarm(frame->function) && jitStackFits()) {                                          \
+			SAVE_FRAME();                                                                          \
+			JitResult result = jitEnter(frame->function, ip);                                      \
+			if (result == JIT_ERROR)                                                               \
+				return INTERPRET_RUNTIME_ERROR;                                                    \
+			if (vm.frameCount == vm.exitFrameCount)                                                \
+				return INTERPRET_OK;                                                               \
+			LOAD_FRAME();                                                                          \
+		}                                                                                          \
+	} while (false)
+#else
+#define ENTER_NATIVE()                                                                             \
+	do {                                                                                           \
+	} while (false)
+#endif
 #define BINARY_OP(valueType, op)                                                                   \
 	do {                                                                                           \
 		if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                                          \
-			runtimeError("Operands must be numbers.");                                             \
-			return INTERPRET_RUNTIME_ERROR;                                                        \
+			RUNTIME_ERROR("Operands must be numbers.");                                            \
 		}                                                                                          \
 		double b = AS_NUMBER(pop());                                                               \
 		double a = AS_NUMBER(pop());                                                               \
 		push(valueType(a op b));                                                                   \
 	} while (false)
+#ifndef NO_QUICKEN
+// Rewrites the instruction being executed into its specialization for the operand types it just
+// saw. The next execution runs the quickened handler, which only guards those types.
+#define QUICKEN(op) (ip[-1] = (op))
+#else
+#define QUICKEN(op) ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+	// Threaded code: every handler jumps straight to the next one through this table, which gives
+	// each opcode its own indirect branch for the predictor instead of sharing the switch's one.
+	static void *dispatchTable[UINT8_COUNT] = {
+		[0 ... UINT8_MAX] = &&DO_UNKNOWN,
+		[OP_CONSTANT] = &&DO_OP_CONSTANT,
+		[OP_NIL] = &&DO_OP_NIL,
+		[OP_TRUE] = &&DO_OP_TRUE,
+		[OP_FALSE] = &&DO_OP_FALSE,
+		[OP_CALL] = &&DO_OP_CALL,
+		[OP_POP] = &&DO_OP_POP,
+		[OP_GET_LOCAL] = &&DO_OP_GET_LOCAL,
+		[OP_SET_LOCAL] = &&DO_OP_SET_LOCAL,
+		[OP_GET_GLOBAL] = &&DO_OP_GET_GLOBAL,
+		[OP_DEFINE_GLOBAL] = &&DO_OP_DEFINE_GLOBAL,
+		[OP_SET_GLOBAL] = &&DO_OP_SET_GLOBAL,
+		[OP_EQUAL] = &&DO_OP_EQUAL,
+		[OP_GREATER] = &&DO_OP_GREATER,
+		[OP_LESS] = &&DO_OP_LESS,
+		[OP_ADD] = &&DO_OP_ADD,
+		[OP_SUBTRACT] = &&DO_OP_SUBTRACT,
+		[OP_MULTIPLY] = &&DO_OP_MULTIPLY,
+		[OP_DIVIDE] = &&DO_OP_DIVIDE,
+		[OP_NOT] = &&DO_OP_NOT,
+		[OP_NEGATE] = &&DO_OP_NEGATE,
+		[OP_PRINT] = &&DO_OP_PRINT,
+		[OP_JUMP] = &&DO_OP_JUMP,
+		[OP_JUMP_IF_FALSE] = &&DO_OP_JUMP_IF_FALSE,
+		[OP_LOOP] = &&DO_OP_LOOP,
+		[OP_RETURN] = &&DO_OP_RETURN,
+		[OP_TAIL_CALL] = &&DO_OP_TAIL_CALL,
+		[OP_ADD_LOCALS] = &&DO_OP_ADD_LOCALS,
+		[OP_LESS_JUMP_IF_FALSE] = &&DO_OP_LESS_JUMP_IF_FALSE,
+		[OP_ADD_CONSTANT] = &&DO_OP_ADD_CONSTANT,
+		[OP_SET_LOCAL_POP] = &&DO_OP_SET_LOCAL_POP,
+		[OP_ADD_NUM] = &&DO_OP_ADD_NUM,
+		[OP_ADD_STR] = &&DO_OP_ADD_STR,
+		[OP_EQUAL_NUM] = &&DO_OP_EQUAL_NUM,
+	};
+#define CASE(op) DO_##op:
+#define DEFAULT DO_UNKNOWN:
+#ifdef PROFILE_OPCODES
+#define DISPATCH()                                                                                 \
+	do {                                                                                           \
+		profileInstruction(*ip);                                                                   \
+		goto *dispatchTable[READ_BYTE()];                                                          \
+	} while (false)
+#else
+#define DISPATCH() goto *dispatchTable[READ_BYTE()]
+#endif
+#else
+#define CASE(op) case op:
+#define DEFAULT default:
+#define DISPATCH() break
+#endif
+
 #ifdef DEBUG_TRACE_EXECUTION
 	printf("%-5s%4s %-16s %4s %-18s%s\n", "BYTE", "LN", "OPCODE", "ARG", "VAL", "STACK");
 #endif
+#ifdef PROFILE_OPCODES
+	profileStart();
+#endif
+#ifdef COMPUTED_GOTO
+	DISPATCH();
+#else
 	for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
 		// Print instruction first, then pad to fixed column, then stack
-		disassembleInstruction(&frame->function->chunk,
-							   (int)(frame->ip - frame->function->chunk.code));
+		disassembleInstruction(&frame->function->chunk, (int)(ip - frame->function->chunk.code));
 		int pad = 50 - getDebugCharsWritten();
 		if (pad < 1)
 			pad = 1;
@@ -154,108 +637,124 @@ static InterpretResult run() {
 		}
 		printf("\n");
 #endif
-		uint8_t instruction;
-		switch (instruction = READ_BYTE()) {
+#ifdef PROFILE_OPCODES
+		profileInstruction(*ip);
+#endif
+		switch (READ_BYTE()) {
+#endif
 
-		case OP_CONSTANT: {
+		CASE(OP_CONSTANT) {
 			Value constant = READ_CONSTANT();
 			push(constant);
-			break;
+			DISPATCH();
 		}
-		case OP_NIL:
+		CASE(OP_NIL) {
 			push(NIL_VAL);
-			break;
-		case OP_TRUE:
+			DISPATCH();
+		}
+		CASE(OP_TRUE) {
 			push(BOOL_VAL(true));
-			break;
-		case OP_FALSE:
+			DISPATCH();
+		}
+		CASE(OP_FALSE) {
 			push(BOOL_VAL(false));
-			break;
-		case OP_POP:
+			DISPATCH();
+		}
+		CASE(OP_POP) {
 			pop();
-			break;
-		case OP_GET_LOCAL: {
+			DISPATCH();
+		}
+		CASE(OP_GET_LOCAL) {
 			uint8_t slot = READ_BYTE();
-			push(frame->slots[slot]);
-			break;
+			push(slots[slot]);
+			DISPATCH();
 		}
-		case OP_SET_LOCAL: {
+		CASE(OP_SET_LOCAL) {
 			uint8_t slot = READ_BYTE();
 			// We peek at the current value on the value stack, and set the value in the
 			// local stack slot to that value
-			frame->slots[slot] = peek(0);
-			break;
+			slots[slot] = peek(0);
+			DISPATCH();
 		}
-		case OP_GET_GLOBAL: {
-			ObjString *name = READ_STRING();
-			Value value;
-			if (!tableGet(&vm.globals, name, &value)) {
-				runtimeError("Undefined variable: '%s'.", name->chars);
-				return INTERPRET_RUNTIME_ERROR;
+		CASE(OP_GET_GLOBAL) {
+			uint16_t slot = READ_GLOBAL();
+			Value value = vm.globalValues.values[slot];
+			if (IS_UNDEFINED(value)) {
+				RUNTIME_ERROR("Undefined variable: '%s'.", GLOBAL_NAME(slot));
 			}
 			push(value);
-			break;
+			DISPATCH();
 		}
-		case OP_DEFINE_GLOBAL: {
-			ObjString *name = READ_STRING();
-			tableSet(&vm.globals, name, peek(0));
+		CASE(OP_DEFINE_GLOBAL) {
+			uint16_t slot = READ_GLOBAL();
+			setGlobal(slot, peek(0));
 			pop();
-			break;
+			DISPATCH();
 		}
-		case OP_SET_GLOBAL: {
-			ObjString *name = READ_STRING();
-			if (tableSet(&vm.globals, name, peek(0))) {
-				// It must already exist if its being set.
-				tableDelete(&vm.globals, name);
-				runtimeError("Undefined variable '%s'.", name->chars);
-				return INTERPRET_RUNTIME_ERROR;
+		CASE(OP_SET_GLOBAL) {
+			uint16_t slot = READ_GLOBAL();
+			// It must already exist if its being set.
+			if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+				RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
 			}
-			break;
+			setGlobal(slot, peek(0));
+			DISPATCH();
 		}
-		case OP_EQUAL: {
+		CASE(OP_EQUAL) {
 			// We need to do get the last 2 values from the stack
 			// And then we compare them
 			// The values must be of any type?
-			Value b = pop();
-			Value a = pop();
-			push(BOOL_VAL(valuesEqual(a, b)));
-			break;
+			// Comparing ropes flattens them, so both stay on the stack until it's done.
+			if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+				QUICKEN(OP_EQUAL_NUM);
+			bool equal = valuesEqual(peek(1), peek(0));
+			pop();
+			pop();
+			push(BOOL_VAL(equal));
+			DISPATCH();
 		}
-		case OP_GREATER:
+		CASE(OP_GREATER) {
 			// We don't pass in a value so we initialize an empty Value
 			BINARY_OP(BOOL_VAL, >);
-			break;
-		case OP_LESS:
+			DISPATCH();
+		}
+		CASE(OP_LESS) {
 			BINARY_OP(BOOL_VAL, <);
-			break;
-		case OP_ADD:
-			if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+			DISPATCH();
+		}
+		CASE(OP_ADD) {
+			if (IS_STRING_LIKE(peek(0)) && IS_STRING_LIKE(peek(1))) {
+				QUICKEN(OP_ADD_STR);
 				concatenate();
 			} else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+				QUICKEN(OP_ADD_NUM);
 				double b = AS_NUMBER(pop());
 				double a = AS_NUMBER(pop());
 				push(NUMBER_VAL(a + b));
 			} else {
-				runtimeError("Operands must be two numbers or two strings.");
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Operands must be two numbers or two strings.");
 			}
-			break;
-		case OP_SUBTRACT:
+			DISPATCH();
+		}
+		CASE(OP_SUBTRACT) {
 			BINARY_OP(NUMBER_VAL, -);
-			break;
-		case OP_MULTIPLY:
+			DISPATCH();
+		}
+		CASE(OP_MULTIPLY) {
 			BINARY_OP(NUMBER_VAL, *);
-			break;
-		case OP_DIVIDE:
+			DISPATCH();
+		}
+		CASE(OP_DIVIDE) {
 			BINARY_OP(NUMBER_VAL, /);
-			break;
-		case OP_NOT:
+			DISPATCH();
+		}
+		CASE(OP_NOT) {
 			push(BOOL_VAL(isFalsey(pop())));
-			break;
-		case OP_NEGATE:
+			DISPATCH();
+		}
+		CASE(OP_NEGATE) {
 			if (!IS_NUMBER(peek(0))) {
-				runtimeError("Operand must be a number");
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Operand must be a number");
 			}
 
 			// The expansion of these macros equals
@@ -264,61 +763,112 @@ static InterpretResult run() {
 			//     (Value){VAL_NUMBER, {.number = -pop().as.number}}
 			// )
 			push(NUMBER_VAL(-AS_NUMBER(pop())));
-			break;
-		case OP_PRINT: {
-			printValue(pop());
+			DISPATCH();
+		}
+		CASE(OP_PRINT) {
+			// Printing a rope flattens it, which allocates, so it's only popped afterwards.
+			printValue(peek(0));
+			pop();
 			printf("\n");
-			break;
+			DISPATCH();
 		}
-		case OP_JUMP: {
+		CASE(OP_JUMP) {
 			uint16_t offset = READ_SHORT();
 			// We don't need to check the condition, likely
 			// if then condition is false, it will jump right past this instruction
 			// like a game of snakes and ladders where you've landed one past the ladder.
-			frame->ip += offset;
-			break;
+			ip += offset;
+			DISPATCH();
 		}
-		case OP_JUMP_IF_FALSE: {
+		CASE(OP_JUMP_IF_FALSE) {
 			// We will jump to the location only if the result is falsey on the top of the value
 			// stack
 			uint16_t offset = READ_SHORT();
 			if (isFalsey(peek(0)))
-				frame->ip += offset;
-			break;
+				ip += offset;
+			DISPATCH();
 		}
-		case OP_LOOP: {
+		CASE(OP_LOOP) {
+			SAFEPOINT();
 			uint16_t offset = READ_SHORT();
-			frame->ip -= offset;
-			break;
+			ip -= offset;
+			// A hot loop carries on in native code from its header.
+			ENTER_NATIVE();
+			DISPATCH();
 		}
-		case OP_CALL: {
+		CASE(OP_CALL) {
+			SAFEPOINT();
 			int count = READ_BYTE();
-			// TODO: We need to check if this matches the function arity
+			CallCache *cache = &callCaches[READ_SHORT()];
+			Value functionPointer = peek(count);
+			// Monomorphic inline cache: a call site that keeps calling the same function has
+			// already had its arity checked against this argument count, so only the room for
+			// its frame is left to check before entering it.
+			if (IS_OBJ(functionPointer) && AS_OBJ(functionPointer) == cache->callee) {
+				ObjFunction *function = (ObjFunction *)cache->callee;
+				SAVE_FRAME();
+				if (!hasRoom(function, count) && !growStacks(function, count))
+					return INTERPRET_RUNTIME_ERROR;
+				pushFrame(function, count);
+				LOAD_FRAME();
+				ENTER_NATIVE();
+				DISPATCH();
+			}
 			// The frame's instruction pointer points into the
 			// bytecode chunks which is different.
-			Value functionPointer = peek(count);
-			if (IS_OBJ(functionPointer)) {
-				switch (OBJ_TYPE(functionPointer)) {
-				case OBJ_FUNCTION: {
-					ObjFunction *function = AS_FUNCTION(functionPointer);
-					// We reach this instruction and we know the stack has the
-					// arguments before it. We need to create a new stack frame and enter the new
-					// function. This stack
-					if (!call(function, count)) {
-						return INTERPRET_RUNTIME_ERROR;
-					}
-					// The moment of truth, my new frame is ready and filled. Now we can activate it
-					// by pointing frame to it.
-					// Call has incremented the frameCount and filled the new frame
-					frame = &vm.frames[vm.frameCount - 1];
+			if (IS_FUNCTION(functionPointer)) {
+				ObjFunction *function = AS_FUNCTION(functionPointer);
+				// The caller's ip has to be in the frame before the callee runs, both for
+				// the return and for stack traces printed while the callee is active.
+				SAVE_FRAME();
+				// We reach this instruction and we know the stack has the
+				// arguments before it. We need to create a new stack frame and enter the new
+				// function. This stack
+				if (!call(function, count)) {
+					return INTERPRET_RUNTIME_ERROR;
 				}
-				default:
-					break;
+				// Arity matched, so the next call with this callee can skip the checks.
+				cache->callee = (Obj *)function;
+				// The moment of truth, my new frame is ready and filled. Now we can activate it
+				// by pointing frame to it.
+				// Call has incremented the frameCount and filled the new frame
+				LOAD_FRAME();
+				ENTER_NATIVE();
+				DISPATCH();
+			}
+			if (IS_NATIVE(functionPointer)) {
+				SAVE_FRAME();
+				if (!callNative(AS_NATIVE(functionPointer), count))
+					return INTERPRET_RUNTIME_ERROR;
+				DISPATCH();
+			}
+			RUNTIME_ERROR("Can only call functions.");
+		}
+		CASE(OP_TAIL_CALL) {
+			SAFEPOINT();
+			int count = READ_BYTE();
+			CallCache *cache = &callCaches[READ_SHORT()];
+			Value functionPointer = peek(count);
+			if (!IS_FUNCTION(functionPointer)) {
+				// A native has no frame to hand over, its result is for the OP_RETURN that follows.
+				if (!IS_NATIVE(functionPointer)) {
+					RUNTIME_ERROR("Can only call functions.");
 				}
+				SAVE_FRAME();
+				if (!callNative(AS_NATIVE(functionPointer), count))
+					return INTERPRET_RUNTIME_ERROR;
+				DISPATCH();
 			}
-			break;
+			// A runtime error's stack trace still shows the frame being replaced.
+			SAVE_FRAME();
+			if (!tailCall(frame, AS_FUNCTION(functionPointer), count, cache))
+				return INTERPRET_RUNTIME_ERROR;
+			LOAD_FRAME();
+			ENTER_NATIVE();
+			DISPATCH();
 		}
-		case OP_RETURN: {
+		CASE(OP_RETURN) {
+			SAFEPOINT();
 			// Store the returning expression in a variable.
 			// The value of the return can be anything, so its a Value.
 			// Peeking but could just as well pop as we're just about to pop the frame off the
@@ -334,20 +884,423 @@ static InterpretResult run() {
 			// We want to decrement the slots pointer to just before the function invocation
 			// This pops off arguments and the function itself.
 			// The frame we currently point to has a slots where its data starts
-			vm.stackTop = frame->slots;
+			vm.stackTop = slots;
 			// Push the returning value back onto stack.
 			push(result);
+#ifdef JIT
+			if (vm.frameCount == vm.exitFrameCount)
+				return INTERPRET_OK;
+#endif
 			// frame->slots = vm.stackTop - argCount - 1;
 			// Then we mark the previous frame as the current
-			frame = &vm.frames[vm.frameCount - 1];
-			break;
+			LOAD_FRAME();
+			DISPATCH();
+		}
+		CASE(OP_ADD_LOCALS) {
+			Value a = slots[READ_BYTE()];
+			Value b = slots[READ_BYTE()];
+			if (IS_NUMBER(a) && IS_NUMBER(b)) {
+				push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+			} else if (IS_STRING_LIKE(a) && IS_STRING_LIKE(b)) {
+				push(a);
+				push(b);
+				concatenate();
+			} else {
+				RUNTIME_ERROR("Operands must be two numbers or two strings.");
+			}
+			DISPATCH();
+		}
+		CASE(OP_LESS_JUMP_IF_FALSE) {
+			// The comparison result never touches the stack, we branch on it directly.
+			uint16_t offset = READ_SHORT();
+			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+				RUNTIME_ERROR("Operands must be numbers.");
+			}
+			double b = AS_NUMBER(pop());
+			double a = AS_NUMBER(pop());
+			if (!(a < b))
+				ip += offset;
+			DISPATCH();
+		}
+		CASE(OP_ADD_CONSTANT) {
+			Value b = READ_CONSTANT();
+			Value a = peek(0);
+			if (IS_NUMBER(a) && IS_NUMBER(b)) {
+				vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+			} else if (IS_STRING_LIKE(a) && IS_STRING_LIKE(b)) {
+				push(b);
+				concatenate();
+			} else {
+				RUNTIME_ERROR("Operands must be two numbers or two strings.");
+			}
+			DISPATCH();
 		}
+		CASE(OP_SET_LOCAL_POP) {
+			slots[READ_BYTE()] = pop();
+			DISPATCH();
+		}
+		// Each quickened handler guards the types it was specialized for. When other types show up
+		// the site is no longer monomorphic, so it turns back into the generic instruction, which
+		// runs it now and may quicken it again.
+		CASE(OP_ADD_NUM) {
+			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+				ip[-1] = OP_ADD;
+				ip--;
+				DISPATCH();
+			}
+			double b = AS_NUMBER(pop());
+			double a = AS_NUMBER(pop());
+			push(NUMBER_VAL(a + b));
+			DISPATCH();
+		}
+		CASE(OP_ADD_STR) {
+			if (!IS_STRING_LIKE(peek(0)) || !IS_STRING_LIKE(peek(1))) {
+				ip[-1] = OP_ADD;
+				ip--;
+				DISPATCH();
+			}
+			concatenate();
+			DISPATCH();
+		}
+		CASE(OP_EQUAL_NUM) {
+			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+				ip[-1] = OP_EQUAL;
+				ip--;
+				DISPATCH();
+			}
+			double b = AS_NUMBER(pop());
+			double a = AS_NUMBER(pop());
+			push(BOOL_VAL(a == b));
+			DISPATCH();
+		}
+		DEFAULT {
+			RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+		}
+
+#ifndef COMPUTED_GOTO
 		}
 	}
+#endif
 
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_GLOBAL
+#undef GLOBAL_NAME
+#undef SAVE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef ENTER_NATIVE
+#undef BINARY_OP
+#undef QUICKEN
+#undef CASE
+#undef DEFAULT
+#undef DISPATCH
+}
+
+// Dispatch loop for the register instruction set, see RegOpCode in chunk.h.
+// Registers are the frame's slots, vm.stackTop sits just past the current frame's register window
+// so the stack above it is free for the callee's frame and for concatenate()'s operands.
+static InterpretResult runRegisters() {
+	CallFrame *frame = &vm.frames[vm.frameCount - 1];
+	register uint8_t *ip = frame->ip;
+	Value *slots = frame->slots;
+	Value *constants = frame->function->chunk.constants.values;
+#define SAVE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME()                                                                               \
+	do {                                                                                           \
+		frame = &vm.frames[vm.frameCount - 1];                                                     \
+		ip = frame->ip;                                                                            \
+		slots = frame->slots;                                                                      \
+		constants = frame->function->chunk.constants.values;                                      \
+	} while (false)
+#define RUNTIME_ERROR(...)                                                                         \
+	do {                                                                                           \
+		SAVE_FRAME();                                                                              \
+		runtimeError(__VA_ARGS__);                                                                 \
+		return INTERPRET_RUNTIME_ERROR;                                                            \
+	} while (false)
+// The arguments are made the top of the stack for callNative(), which leaves the result in R(A).
+// Registers above the arguments are dead at a call, the window is restored afterwards.
+#define CALL_NATIVE(callee, argCount)                                                              \
+	do {                                                                                           \
+		SAVE_FRAME();                                                                              \
+		vm.stackTop = &R(A) + (argCount) + 1;                                                      \
+		if (!callNative(AS_NATIVE(callee), (argCount)))                                            \
+			return INTERPRET_RUNTIME_ERROR;                                                        \
+		vm.stackTop = slots + frame->function->regCount;                                           \
+	} while (false)
+#define A (ip[-3])
+#define B (ip[-2])
+#define C (ip[-1])
+#define R(index) (slots[index])
+#define K(index) (constants[index])
+#define OFFSET(hi, lo) ((int16_t)(((hi) << 8) | (lo)))
+#define GLOBAL(hi, lo) (vm.globalValues.values[((hi) << 8) | (lo)])
+#define GLOBAL_NAME(hi, lo) (AS_STRING(vm.globalNames.values[((hi) << 8) | (lo)])->chars)
+#define BINARY_OP(valueType, op)                                                                   \
+	do {                                                                                           \
+		Value b = R(C);                                                                            \
+		Value a = R(B);                                                                            \
+		if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                                      \
+			RUNTIME_ERROR("Operands must be numbers.");                                            \
+		}                                                                                          \
+		R(A) = valueType(AS_NUMBER(a) op AS_NUMBER(b));                                            \
+	} while (false)
+#define ADD(a, b)                                                                                  \
+	do {                                                                                           \
+		if (IS_NUMBER(a) && IS_NUMBER(b)) {                                                        \
+			R(A) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));                                        \
+		} else if (IS_STRING_LIKE(a) && IS_STRING_LIKE(b)) {                                       \
+			push(a);                                                                               \
+			push(b);                                                                               \
+			concatenate();                                                                         \
+			R(A) = pop();                                                                          \
+		} else {                                                                                   \
+			RUNTIME_ERROR("Operands must be two numbers or two strings.");                         \
+		}                                                                                          \
+	} while (false)
+
+#ifdef COMPUTED_GOTO
+	static void *dispatchTable[UINT8_COUNT] = {
+		[0 ... UINT8_MAX] = &&DO_UNKNOWN,
+		[ROP_MOVE] = &&DO_ROP_MOVE,
+		[ROP_LOADK] = &&DO_ROP_LOADK,
+		[ROP_LOADNIL] = &&DO_ROP_LOADNIL,
+		[ROP_LOADTRUE] = &&DO_ROP_LOADTRUE,
+		[ROP_LOADFALSE] = &&DO_ROP_LOADFALSE,
+		[ROP_GET_GLOBAL] = &&DO_ROP_GET_GLOBAL,
+		[ROP_DEFINE_GLOBAL] = &&DO_ROP_DEFINE_GLOBAL,
+		[ROP_SET_GLOBAL] = &&DO_ROP_SET_GLOBAL,
+		[ROP_EQUAL] = &&DO_ROP_EQUAL,
+		[ROP_GREATER] = &&DO_ROP_GREATER,
+		[ROP_LESS] = &&DO_ROP_LESS,
+		[ROP_ADD] = &&DO_ROP_ADD,
+		[ROP_ADD_CONSTANT] = &&DO_ROP_ADD_CONSTANT,
+		[ROP_SUBTRACT] = &&DO_ROP_SUBTRACT,
+		[ROP_MULTIPLY] = &&DO_ROP_MULTIPLY,
+		[ROP_DIVIDE] = &&DO_ROP_DIVIDE,
+		[ROP_NOT] = &&DO_ROP_NOT,
+		[ROP_NEGATE] = &&DO_ROP_NEGATE,
+		[ROP_PRINT] = &&DO_ROP_PRINT,
+		[ROP_JUMP] = &&DO_ROP_JUMP,
+		[ROP_JUMP_IF_FALSE] = &&DO_ROP_JUMP_IF_FALSE,
+		[ROP_LESS_JUMP] = &&DO_ROP_LESS_JUMP,
+		[ROP_CALL] = &&DO_ROP_CALL,
+		[ROP_TAIL_CALL] = &&DO_ROP_TAIL_CALL,
+		[ROP_RETURN] = &&DO_ROP_RETURN,
+	};
+#define CASE(op) DO_##op:
+#define DEFAULT DO_UNKNOWN:
+#define DISPATCH() goto *dispatchTable[(ip += REG_INSTRUCTION_SIZE)[-REG_INSTRUCTION_SIZE]]
+	DISPATCH();
+#else
+#define CASE(op) case op:
+#define DEFAULT default:
+#define DISPATCH() break
+	for (;;) {
+		ip += REG_INSTRUCTION_SIZE;
+		switch (ip[-REG_INSTRUCTION_SIZE]) {
+#endif
+
+		CASE(ROP_MOVE) {
+			R(A) = R(B);
+			DISPATCH();
+		}
+		CASE(ROP_LOADK) {
+			R(A) = K(B);
+			DISPATCH();
+		}
+		CASE(ROP_LOADNIL) {
+			R(A) = NIL_VAL;
+			DISPATCH();
+		}
+		CASE(ROP_LOADTRUE) {
+			R(A) = BOOL_VAL(true);
+			DISPATCH();
+		}
+		CASE(ROP_LOADFALSE) {
+			R(A) = BOOL_VAL(false);
+			DISPATCH();
+		}
+		CASE(ROP_GET_GLOBAL) {
+			Value value = GLOBAL(B, C);
+			if (IS_UNDEFINED(value)) {
+				RUNTIME_ERROR("Undefined variable: '%s'.", GLOBAL_NAME(B, C));
+			}
+			R(A) = value;
+			DISPATCH();
+		}
+		CASE(ROP_DEFINE_GLOBAL) {
+			setGlobal((B << 8) | C, R(A));
+			DISPATCH();
+		}
+		CASE(ROP_SET_GLOBAL) {
+			if (IS_UNDEFINED(GLOBAL(B, C))) {
+				RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(B, C));
+			}
+			setGlobal((B << 8) | C, R(A));
+			DISPATCH();
+		}
+		CASE(ROP_EQUAL) {
+			R(A) = BOOL_VAL(valuesEqual(R(B), R(C)));
+			DISPATCH();
+		}
+		CASE(ROP_GREATER) {
+			BINARY_OP(BOOL_VAL, >);
+			DISPATCH();
+		}
+		CASE(ROP_LESS) {
+			BINARY_OP(BOOL_VAL, <);
+			DISPATCH();
+		}
+		CASE(ROP_ADD) {
+			Value a = R(B);
+			Value b = R(C);
+			ADD(a, b);
+			DISPATCH();
+		}
+		CASE(ROP_ADD_CONSTANT) {
+			Value a = R(B);
+			Value b = K(C);
+			ADD(a, b);
+			DISPATCH();
+		}
+		CASE(ROP_SUBTRACT) {
+			BINARY_OP(NUMBER_VAL, -);
+			DISPATCH();
+		}
+		CASE(ROP_MULTIPLY) {
+			BINARY_OP(NUMBER_VAL, *);
+			DISPATCH();
+		}
+		CASE(ROP_DIVIDE) {
+			BINARY_OP(NUMBER_VAL, /);
+			DISPATCH();
+		}
+		CASE(ROP_NOT) {
+			R(A) = BOOL_VAL(isFalsey(R(B)));
+			DISPATCH();
+		}
+		CASE(ROP_NEGATE) {
+			if (!IS_NUMBER(R(B))) {
+				RUNTIME_ERROR("Operand must be a number");
+			}
+			R(A) = NUMBER_VAL(-AS_NUMBER(R(B)));
+			DISPATCH();
+		}
+		CASE(ROP_PRINT) {
+			printValue(R(A));
+			printf("\n");
+			DISPATCH();
+		}
+		CASE(ROP_JUMP) {
+			// Every loop's back edge is a ROP_JUMP.
+			SAFEPOINT();
+			ip += OFFSET(B, C);
+			DISPATCH();
+		}
+		CASE(ROP_JUMP_IF_FALSE) {
+			if (isFalsey(R(A)))
+				ip += OFFSET(B, C);
+			DISPATCH();
+		}
+		CASE(ROP_LESS_JUMP) {
+			Value a = R(A);
+			Value b = R(B);
+			if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+				RUNTIME_ERROR("Operands must be numbers.");
+			}
+			// The ROP_JUMP that follows holds the offset, it is skipped when the test passes.
+			ip += REG_INSTRUCTION_SIZE;
+			if (!(AS_NUMBER(a) < AS_NUMBER(b)))
+				ip += OFFSET(ip[-2], ip[-1]);
+			DISPATCH();
+		}
+		CASE(ROP_CALL) {
+			SAFEPOINT();
+			Value callee = R(A);
+			int argCount = B;
+			if (IS_NATIVE(callee)) {
+				CALL_NATIVE(callee, argCount);
+				DISPATCH();
+			}
+			if (!IS_FUNCTION(callee)) {
+				RUNTIME_ERROR("Can only call functions.");
+			}
+			ObjFunction *function = AS_FUNCTION(callee);
+			SAVE_FRAME();
+			vm.stackTop = &R(A) + argCount + 1;
+			// call() makes room for the whole register window, possibly moving the stack.
+			if (!call(function, argCount))
+				return INTERPRET_RUNTIME_ERROR;
+			CallFrame *calleeFrame = &vm.frames[vm.frameCount - 1];
+			calleeFrame->ip = function->regChunk.code;
+			enterRegisterWindow(calleeFrame->slots + function->regCount);
+			LOAD_FRAME();
+			DISPATCH();
+		}
+		CASE(ROP_TAIL_CALL) {
+			SAFEPOINT();
+			Value callee = R(A);
+			int argCount = B;
+			if (IS_NATIVE(callee)) {
+				CALL_NATIVE(callee, argCount);
+				DISPATCH();
+			}
+			if (!IS_FUNCTION(callee)) {
+				RUNTIME_ERROR("Can only call functions.");
+			}
+			ObjFunction *function = AS_FUNCTION(callee);
+			SAVE_FRAME();
+			// Everything above the callee register is dead, the callee and arguments are the top.
+			vm.stackTop = &R(A) + argCount + 1;
+			if (!replaceFrame(frame, function, argCount))
+				return INTERPRET_RUNTIME_ERROR;
+			frame->ip = function->regChunk.code;
+			enterRegisterWindow(frame->slots + function->regCount);
+			LOAD_FRAME();
+			DISPATCH();
+		}
+		CASE(ROP_RETURN) {
+			SAFEPOINT();
+			Value result = R(A);
+			vm.frameCount--;
+			if (vm.frameCount == 0) {
+				vm.stackTop = vm.stack;
+				return INTERPRET_OK;
+			}
+			// The callee's slot zero is the caller's call register.
+			slots[0] = result;
+			LOAD_FRAME();
+			vm.stackTop = slots + frame->function->regCount;
+			DISPATCH();
+		}
+		DEFAULT {
+			RUNTIME_ERROR("Unknown register opcode %d.", ip[-REG_INSTRUCTION_SIZE]);
+		}
+
+#ifndef COMPUTED_GOTO
+		}
+	}
+#endif
+
+#undef SAVE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef A
+#undef B
+#undef C
+#undef R
+#undef K
+#undef OFFSET
+#undef CALL_NATIVE
+#undef GLOBAL
+#undef GLOBAL_NAME
 #undef BINARY_OP
+#undef ADD
+#undef CASE
+#undef DEFAULT
+#undef DISPATCH
 }
@@ -3,21 +3,51 @@
 
 #include "object.h"
 #include "value.h"
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Hard limits for the growable stacks, overridden by the CMake cache variables of the same name.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 262144
+#endif
+#ifndef STACK_MAX
+#define STACK_MAX (4 * 1024 * 1024)
+#endif
+// What a fresh VM reserves before any growth.
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL 1024
+// Values the runtime may push above a frame's own maximum depth, to keep temporaries reachable by
+// the collector.
+#define STACK_RESERVE 8
 
 #include "chunk.h"
 #include "table.h"
 
+// Values a call of function needs from its callee slot up. A register window may be larger than
+// the stack code's own maximum depth.
+static inline int frameSize(ObjFunction *function) {
+	int size = function->maxStack > function->regCount ? function->maxStack : function->regCount;
+	return size + STACK_RESERVE;
+}
+
 typedef struct {
 	ObjFunction *function;
 	uint8_t *ip;
 	Value *slots;
 } CallFrame;
 
+// Which instruction set interpret() executes. The register backend falls back to the stack one
+// when a program can't be translated.
+typedef enum { BACKEND_STACK, BACKEND_REGISTER } Backend;
+
+// A heap slot that may point into the nursery, see WRITE_BARRIER in memory.h.
 typedef struct {
-	CallFrame frames[FRAMES_MAX];
+	ValueArray *array;
+	int index;
+} RememberedSlot;
+
+typedef struct {
+	// Grows in call(), so a CallFrame pointer is only good until the next call.
+	CallFrame *frames;
 	int frameCount;
+	int frameCapacity;
 	Chunk *chunk;
 	// Points into a location in the chunk array
 	uint8_t *ip;
@@ -26,16 +56,49 @@ typedef struct {
 	// https://stackoverflow.com/questions/44346433/in-c-python-accessing-the-bytecode-evaluation-stack
 	// https://github.com/python/cpython/blob/2.7/Include/frameobject.h#L23
 	// PyFrameObject https://shanechang.com/p/python-frames-systems-programming-connection/
-	Value stack[STACK_MAX];
+	// Grows in call() so that the callee's whole frame fits, push() itself never checks. Growing
+	// moves it, so pointers into it have to be reloaded from the frames after a call.
+	Value *stack;
+	int stackCapacity;
 	// Pointer to the latest value in `stack` Value above.
 	// Python stores in stack_pointer local variable
 	// https://github.com/python/cpython/blob/v3.8.2/Python/ceval.c#L1153
 	Value *stackTop;
+	// Maps each global's name to its slot in globalValues. The compiler resolves names through it,
+	// the VM itself only ever indexes the arrays below.
 	Table globals;
+	// Flat storage for globals, UNDEFINED_VAL until the global is defined.
+	ValueArray globalValues;
+	// Name of each global slot, for error messages.
+	ValueArray globalNames;
 	Table strings;
 	// Linked List head pointer for garbage collector to mark and sweep all dynamically allocated
 	// https://craftinginterpreters.com/strings.html#freeing-objects.
 	Obj *objects;
+	// Bytes currently handed out by reallocate(), and the count that triggers the next collection.
+	size_t bytesAllocated;
+	size_t nextGC;
+	// Marked objects whose references haven't been traced yet.
+	int grayCount;
+	int grayCapacity;
+	Obj **grayStack;
+	// Young generation: runtime strings are bump-allocated between nurseryStart and nurseryEnd.
+	uint8_t *nurseryStart;
+	uint8_t *nurseryTop;
+	uint8_t *nurseryEnd;
+	// Slots outside the stack that held a young value when it was stored, the extra roots of a
+	// minor collection.
+	int rememberedCount;
+	int rememberedCapacity;
+	RememberedSlot *remembered;
+	Backend backend;
+#ifdef JIT
+	// Native code isn't entered with the C stack below this, see JIT_STACK_MAX.
+	uintptr_t jitStackLimit;
+	// run() returns once a return brings frameCount down to this. Zero except in the nested run()
+	// that finishes a call made from native code.
+	int exitFrameCount;
+#endif
 } VM;
 
 typedef enum { INTERPRET_OK, INTERPRET_COMPILE_ERROR, INTERPRET_RUNTIME_ERROR } InterpretResult;
@@ -47,8 +110,15 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char *source);
+// Runs an already compiled script, e.g. one loaded from the bytecode cache.
+InterpretResult interpretFunction(ObjFunction *function);
+int globalSlot(ObjString *name);
+// Binds a C function to the global `name`. Natives take exactly `arity` arguments.
+void defineNative(const char *name, NativeFn function, int arity);
+// Source line of the instruction a frame is executing, or for a caller the call it is waiting on.
+// Only exact once the running loop has written its ip back to the frame.
+int frameLine(CallFrame *frame);
 void push(Value value);
 Value pop();
-static InterpretResult run();
 
 #endif